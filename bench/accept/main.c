@@ -0,0 +1,429 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <libweb/handler.h>
+#include <libweb/http.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct conn
+{
+    bool sent;
+    size_t n;
+    char buf[256];
+};
+
+static const char request[] = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+/* Pending connections are given up on after this many seconds. */
+static const int deadline = 60;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    {
+        fprintf(stderr, "%s: clock_gettime(2): %s\n", __func__,
+            strerror(errno));
+        return -1;
+    }
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int hello(const struct http_payload *const pl,
+    struct http_response *const r, void *const user)
+{
+    *r = (const struct http_response)
+    {
+        .status = HTTP_STATUS_OK
+    };
+
+    return 0;
+}
+
+static int serve(const rlim_t nofile, const int fd)
+{
+    int ret = EXIT_FAILURE;
+    const struct handler_cfg cfg = {0};
+    struct handler *const h = handler_alloc(&cfg);
+    unsigned short port;
+
+    /* Request lines are logged to standard output. */
+    if (!freopen("/dev/null", "w", stdout))
+    {
+        fprintf(stderr, "%s: freopen(3): %s\n", __func__, strerror(errno));
+        goto end;
+    }
+    else if (nofile)
+    {
+        const struct rlimit rl = {.rlim_cur = nofile, .rlim_max = nofile};
+
+        if (setrlimit(RLIMIT_NOFILE, &rl))
+        {
+            fprintf(stderr, "%s: setrlimit(2): %s\n", __func__,
+                strerror(errno));
+            goto end;
+        }
+    }
+
+    if (!h)
+    {
+        fprintf(stderr, "%s: handler_alloc failed\n", __func__);
+        goto end;
+    }
+    else if (handler_add(h, "/", HTTP_OP_GET, hello, NULL))
+    {
+        fprintf(stderr, "%s: handler_add failed\n", __func__);
+        goto end;
+    }
+    else if (handler_listen(h, 0, &port))
+    {
+        fprintf(stderr, "%s: handler_listen failed\n", __func__);
+        goto end;
+    }
+    else if (write(fd, &port, sizeof port) != sizeof port)
+    {
+        fprintf(stderr, "%s: write(2): %s\n", __func__, strerror(errno));
+        goto end;
+    }
+    else if (close(fd))
+    {
+        fprintf(stderr, "%s: close(2): %s\n", __func__, strerror(errno));
+        goto end;
+    }
+    else if (handler_loop(h))
+    {
+        fprintf(stderr, "%s: handler_loop failed\n", __func__);
+        goto end;
+    }
+
+    ret = EXIT_SUCCESS;
+
+end:
+    handler_free(h);
+    return ret;
+}
+
+static int raise_nofile(const size_t n)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl))
+    {
+        fprintf(stderr, "%s: getrlimit(2): %s\n", __func__,
+            strerror(errno));
+        return -1;
+    }
+
+    rl.rlim_cur = rl.rlim_max;
+
+    if (setrlimit(RLIMIT_NOFILE, &rl))
+    {
+        fprintf(stderr, "%s: setrlimit(2): %s\n", __func__,
+            strerror(errno));
+        return -1;
+    }
+    else if (rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < n + 16)
+    {
+        fprintf(stderr, "%s: %zu connections exceed RLIMIT_NOFILE (%lu)\n",
+            __func__, n, (unsigned long)rl.rlim_cur);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int connect_all(struct pollfd *const fds, const size_t n,
+    const unsigned short port)
+{
+    const struct sockaddr_in addr =
+    {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    };
+
+    for (size_t i = 0; i < n; i++)
+    {
+        struct pollfd *const p = &fds[i];
+        const int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+        if (fd < 0)
+        {
+            fprintf(stderr, "%s: socket(2): %s\n", __func__,
+                strerror(errno));
+            return -1;
+        }
+
+        *p = (const struct pollfd){.fd = fd, .events = POLLOUT};
+
+        if (fcntl(fd, F_SETFL, O_NONBLOCK))
+        {
+            fprintf(stderr, "%s: fcntl(2): %s\n", __func__,
+                strerror(errno));
+            return -1;
+        }
+        else if (connect(fd, (const struct sockaddr *)&addr, sizeof addr)
+            && errno != EINPROGRESS)
+        {
+            fprintf(stderr, "%s: connect(2): %s\n", __func__,
+                strerror(errno));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Returns zero if the connection is still pending, a positive integer if
+ * a response was received, or a negative integer otherwise. */
+static int step(struct pollfd *const p, struct conn *const c)
+{
+    if (p->revents & (POLLERR | POLLNVAL))
+        return -1;
+    else if (!c->sent)
+    {
+        if (!(p->revents & POLLOUT))
+            return 0;
+        else if (send(p->fd, request, strlen(request), 0) < 0)
+            return -1;
+
+        c->sent = true;
+        p->events = POLLIN;
+        return 0;
+    }
+    else if (!(p->revents & (POLLIN | POLLHUP)))
+        return 0;
+
+    const ssize_t r = recv(p->fd, c->buf + c->n, sizeof c->buf - c->n - 1,
+        0);
+
+    if (r <= 0)
+        return -1;
+
+    c->n += r;
+    c->buf[c->n] = '\0';
+
+    if (strstr(c->buf, "\r\n\r\n"))
+        return strncmp(c->buf, "HTTP/1.1 200", strlen("HTTP/1.1 200")) ?
+            -1 : 1;
+
+    return c->n == sizeof c->buf - 1 ? -1 : 0;
+}
+
+static int storm(const size_t n, const unsigned short port,
+    size_t *const ok, size_t *const failed)
+{
+    int ret = -1;
+    struct pollfd *const fds = malloc(n * sizeof *fds);
+    struct conn *const c = calloc(n, sizeof *c);
+    size_t pending = n;
+
+    *ok = *failed = 0;
+
+    if (!fds || !c)
+    {
+        fprintf(stderr, "%s: malloc(3): %s\n", __func__, strerror(errno));
+        goto end;
+    }
+
+    for (size_t i = 0; i < n; i++)
+        fds[i].fd = -1;
+
+    if (connect_all(fds, n, port))
+    {
+        fprintf(stderr, "%s: connect_all failed\n", __func__);
+        goto end;
+    }
+
+    const double start = now();
+
+    while (pending)
+    {
+        const int res = poll(fds, n, 1000);
+
+        if (res < 0)
+        {
+            fprintf(stderr, "%s: poll(2): %s\n", __func__, strerror(errno));
+            goto end;
+        }
+        else if (now() - start > deadline)
+            break;
+
+        for (size_t i = 0; i < n; i++)
+        {
+            struct pollfd *const p = &fds[i];
+
+            if (p->fd < 0 || !p->revents)
+                continue;
+
+            const int st = step(p, &c[i]);
+
+            if (!st)
+                continue;
+            else if (st > 0)
+                ++*ok;
+            else
+                ++*failed;
+
+            close(p->fd);
+            p->fd = -1;
+            pending--;
+        }
+    }
+
+    *failed += pending;
+    ret = 0;
+
+end:
+    if (fds)
+        for (size_t i = 0; i < n; i++)
+            if (fds[i].fd >= 0)
+                close(fds[i].fd);
+
+    free(fds);
+    free(c);
+    return ret;
+}
+
+/* The server only notices SIGTERM if it interrupts a wait for events, so
+ * it is sent again until the server exits. */
+static int stop(const pid_t pid)
+{
+    const struct timespec ts = {.tv_nsec = 100 * 1000 * 1000};
+
+    for (;;)
+    {
+        const pid_t w = waitpid(pid, NULL, WNOHANG);
+
+        if (w < 0)
+        {
+            fprintf(stderr, "%s: waitpid(2): %s\n", __func__,
+                strerror(errno));
+            return -1;
+        }
+        else if (w)
+            return 0;
+        else if (kill(pid, SIGTERM))
+        {
+            fprintf(stderr, "%s: kill(2): %s\n", __func__, strerror(errno));
+            return -1;
+        }
+
+        nanosleep(&ts, NULL);
+    }
+}
+
+static int parse(const char *const s, unsigned long *const out)
+{
+    char *end;
+
+    errno = 0;
+    *out = strtoul(s, &end, 10);
+
+    if (errno || *end || !*out)
+    {
+        fprintf(stderr, "%s: invalid number: %s\n", __func__, s);
+        return -1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int ret = EXIT_FAILURE, fds[2] = {-1, -1};
+    unsigned long n = 10000, nofile = 0;
+    unsigned short port;
+    pid_t pid = -1;
+
+    if (argc > 3)
+    {
+        fprintf(stderr, "%s [connections [server-nofile]]\n", *argv);
+        return EXIT_FAILURE;
+    }
+    else if ((argc > 1 && parse(argv[1], &n))
+        || (argc > 2 && parse(argv[2], &nofile)))
+        return EXIT_FAILURE;
+    else if (raise_nofile(n))
+    {
+        fprintf(stderr, "%s: raise_nofile failed\n", __func__);
+        return EXIT_FAILURE;
+    }
+    else if (pipe(fds))
+    {
+        fprintf(stderr, "%s: pipe(2): %s\n", __func__, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    else if ((pid = fork()) < 0)
+    {
+        fprintf(stderr, "%s: fork(2): %s\n", __func__, strerror(errno));
+        goto end;
+    }
+    else if (!pid)
+    {
+        close(fds[0]);
+        exit(serve(nofile, fds[1]));
+    }
+
+    close(fds[1]);
+    fds[1] = -1;
+
+    if (read(fds[0], &port, sizeof port) != sizeof port)
+    {
+        fprintf(stderr, "%s: server failed to start\n", __func__);
+        goto end;
+    }
+
+    size_t ok, failed;
+    const double start = now();
+
+    if (storm(n, port, &ok, &failed))
+    {
+        fprintf(stderr, "%s: storm failed\n", __func__);
+        goto end;
+    }
+
+    const double t = now() - start;
+    const pid_t w = waitpid(pid, NULL, WNOHANG);
+
+    if (w < 0)
+    {
+        fprintf(stderr, "%s: waitpid(2): %s\n", __func__, strerror(errno));
+        goto end;
+    }
+
+    printf("connections: %lu, ok: %zu, failed: %zu, %.2f s, %.0f conn/s, "
+        "server: %s\n", n, ok, failed, t, ok / t,
+        w ? "stopped" : "running");
+
+    if (w)
+        pid = -1;
+    else if (!failed)
+        ret = EXIT_SUCCESS;
+
+end:
+    if (pid > 0 && stop(pid))
+        ret = EXIT_FAILURE;
+
+    for (size_t i = 0; i < sizeof fds / sizeof *fds; i++)
+        if (fds[i] >= 0)
+            close(fds[i]);
+
+    return ret;
+}
@@ -0,0 +1,452 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <libweb/handler.h>
+#include <libweb/http.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct conn
+{
+    bool sent, done;
+    size_t n;
+    char buf[256];
+};
+
+static const char request[] = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+static int hello(const struct http_payload *const pl,
+    struct http_response *const r, void *const user)
+{
+    *r = (const struct http_response)
+    {
+        .status = HTTP_STATUS_OK
+    };
+
+    return 0;
+}
+
+static int serve(const int fd)
+{
+    int ret = EXIT_FAILURE;
+    /* No timeouts are set, so idle connections are never closed. */
+    const struct handler_cfg cfg = {0};
+    struct handler *const h = handler_alloc(&cfg);
+    unsigned short port;
+
+    /* Request lines are logged to standard output. */
+    if (!freopen("/dev/null", "w", stdout))
+    {
+        fprintf(stderr, "%s: freopen(3): %s\n", __func__, strerror(errno));
+        goto end;
+    }
+    else if (!h)
+    {
+        fprintf(stderr, "%s: handler_alloc failed\n", __func__);
+        goto end;
+    }
+    else if (handler_add(h, "/", HTTP_OP_GET, hello, NULL))
+    {
+        fprintf(stderr, "%s: handler_add failed\n", __func__);
+        goto end;
+    }
+    else if (handler_listen(h, 0, &port))
+    {
+        fprintf(stderr, "%s: handler_listen failed\n", __func__);
+        goto end;
+    }
+    else if (write(fd, &port, sizeof port) != sizeof port)
+    {
+        fprintf(stderr, "%s: write(2): %s\n", __func__, strerror(errno));
+        goto end;
+    }
+    else if (close(fd))
+    {
+        fprintf(stderr, "%s: close(2): %s\n", __func__, strerror(errno));
+        goto end;
+    }
+    else if (handler_loop(h))
+    {
+        fprintf(stderr, "%s: handler_loop failed\n", __func__);
+        goto end;
+    }
+
+    ret = EXIT_SUCCESS;
+
+end:
+    handler_free(h);
+    return ret;
+}
+
+static int raise_nofile(const size_t n)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl))
+    {
+        fprintf(stderr, "%s: getrlimit(2): %s\n", __func__,
+            strerror(errno));
+        return -1;
+    }
+
+    rl.rlim_cur = rl.rlim_max;
+
+    if (setrlimit(RLIMIT_NOFILE, &rl))
+    {
+        fprintf(stderr, "%s: setrlimit(2): %s\n", __func__,
+            strerror(errno));
+        return -1;
+    }
+    else if (rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < n + 16)
+    {
+        fprintf(stderr, "%s: %zu connections exceed RLIMIT_NOFILE (%lu)\n",
+            __func__, n, (unsigned long)rl.rlim_cur);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Returns the resident set size of a process, in bytes, or zero on
+ * failure. */
+static unsigned long long rss(const pid_t pid)
+{
+    unsigned long long ret = 0, size, resident;
+    char path[sizeof "/proc//statm" + 3 * sizeof pid];
+    FILE *f = NULL;
+    const long page = sysconf(_SC_PAGESIZE);
+
+    snprintf(path, sizeof path, "/proc/%ld/statm", (long)pid);
+
+    if (page < 0)
+    {
+        fprintf(stderr, "%s: sysconf(3): %s\n", __func__, strerror(errno));
+        goto end;
+    }
+    else if (!(f = fopen(path, "rb")))
+    {
+        fprintf(stderr, "%s: fopen(3) %s: %s\n", __func__, path,
+            strerror(errno));
+        goto end;
+    }
+    else if (fscanf(f, "%llu %llu", &size, &resident) != 2)
+    {
+        fprintf(stderr, "%s: failed to parse %s\n", __func__, path);
+        goto end;
+    }
+
+    ret = resident * page;
+
+end:
+    if (f && fclose(f))
+        fprintf(stderr, "%s: fclose(3): %s\n", __func__, strerror(errno));
+
+    return ret;
+}
+
+/* Returns zero if the connection is still pending, a positive integer if
+ * a response was received, or a negative integer otherwise. */
+static int step(struct pollfd *const p, struct conn *const c)
+{
+    if (p->revents & (POLLERR | POLLNVAL))
+        return -1;
+    else if (!c->sent)
+    {
+        if (!(p->revents & POLLOUT))
+            return 0;
+        else if (send(p->fd, request, strlen(request), 0) < 0)
+            return -1;
+
+        c->sent = true;
+        p->events = POLLIN;
+        return 0;
+    }
+    else if (!(p->revents & (POLLIN | POLLHUP)))
+        return 0;
+
+    const ssize_t r = recv(p->fd, c->buf + c->n, sizeof c->buf - c->n - 1,
+        0);
+
+    if (r <= 0)
+        return -1;
+
+    c->n += r;
+    c->buf[c->n] = '\0';
+
+    if (strstr(c->buf, "\r\n\r\n"))
+        return strncmp(c->buf, "HTTP/1.1 200", strlen("HTTP/1.1 200")) ?
+            -1 : 1;
+
+    return c->n == sizeof c->buf - 1 ? -1 : 0;
+}
+
+/* Opens n connections and sends one request on each. Connections are
+ * left open once their response is received, so that they become idle
+ * on the server. */
+static int connect_batch(struct pollfd *const fds, struct conn *const c,
+    const size_t n, const struct sockaddr_in *const addr)
+{
+    size_t pending = n;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        struct pollfd *const p = &fds[i];
+        const int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+        if (fd < 0)
+        {
+            fprintf(stderr, "%s: socket(2): %s\n", __func__,
+                strerror(errno));
+            return -1;
+        }
+
+        *p = (const struct pollfd){.fd = fd, .events = POLLOUT};
+
+        if (fcntl(fd, F_SETFL, O_NONBLOCK))
+        {
+            fprintf(stderr, "%s: fcntl(2): %s\n", __func__,
+                strerror(errno));
+            return -1;
+        }
+        else if (connect(fd, (const struct sockaddr *)addr, sizeof *addr)
+            && errno != EINPROGRESS)
+        {
+            fprintf(stderr, "%s: connect(2): %s\n", __func__,
+                strerror(errno));
+            return -1;
+        }
+    }
+
+    while (pending)
+    {
+        if (poll(fds, n, -1) < 0)
+        {
+            fprintf(stderr, "%s: poll(2): %s\n", __func__, strerror(errno));
+            return -1;
+        }
+
+        for (size_t i = 0; i < n; i++)
+        {
+            struct pollfd *const p = &fds[i];
+
+            if (c[i].done || !p->revents)
+                continue;
+
+            const int st = step(p, &c[i]);
+
+            if (st < 0)
+            {
+                fprintf(stderr, "%s: connection failed\n", __func__);
+                return -1;
+            }
+            else if (st)
+            {
+                c[i].done = true;
+                p->events = 0;
+                pending--;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Connections are opened in small batches, so that the listen backlog
+ * from the server does not overflow. */
+static int connect_idle(struct pollfd *const fds, const size_t n,
+    const unsigned short port)
+{
+    enum {BATCH = 64, PER_ADDR = 25000};
+    int ret = -1;
+    struct conn *const c = calloc(n, sizeof *c);
+
+    if (!c)
+    {
+        fprintf(stderr, "%s: calloc(3): %s\n", __func__, strerror(errno));
+        goto end;
+    }
+
+    for (size_t i = 0; i < n; i += BATCH)
+    {
+        const size_t rem = n - i, m = rem > BATCH ? BATCH : rem;
+        /* Ephemeral ports are limited for a given destination, so
+         * connections are spread over several loopback addresses. The
+         * server listens on all of them. */
+        const struct sockaddr_in addr =
+        {
+            .sin_family = AF_INET,
+            .sin_port = htons(port),
+            .sin_addr.s_addr = htonl(INADDR_LOOPBACK + i / PER_ADDR)
+        };
+
+        if (connect_batch(fds + i, c + i, m, &addr))
+        {
+            fprintf(stderr, "%s: connect_batch failed\n", __func__);
+            goto end;
+        }
+    }
+
+    ret = 0;
+
+end:
+    free(c);
+    return ret;
+}
+
+/* The server only notices SIGTERM if it interrupts a wait for events, so
+ * it is sent again until the server exits. */
+static int stop(const pid_t pid)
+{
+    const struct timespec ts = {.tv_nsec = 100 * 1000 * 1000};
+
+    for (;;)
+    {
+        const pid_t w = waitpid(pid, NULL, WNOHANG);
+
+        if (w < 0)
+        {
+            fprintf(stderr, "%s: waitpid(2): %s\n", __func__,
+                strerror(errno));
+            return -1;
+        }
+        else if (w)
+            return 0;
+        else if (kill(pid, SIGTERM))
+        {
+            fprintf(stderr, "%s: kill(2): %s\n", __func__, strerror(errno));
+            return -1;
+        }
+
+        nanosleep(&ts, NULL);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int ret = EXIT_FAILURE, fds[2] = {-1, -1};
+    unsigned long n = 100000;
+    unsigned short port;
+    pid_t pid = -1;
+    struct pollfd *p = NULL;
+
+    if (argc > 2)
+    {
+        fprintf(stderr, "%s [connections]\n", *argv);
+        return EXIT_FAILURE;
+    }
+    else if (argc == 2)
+    {
+        char *end;
+
+        errno = 0;
+        n = strtoul(argv[1], &end, 10);
+
+        if (errno || *end || !n)
+        {
+            fprintf(stderr, "%s: invalid number of connections: %s\n",
+                __func__, argv[1]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (raise_nofile(n))
+    {
+        fprintf(stderr, "%s: raise_nofile failed\n", __func__);
+        return EXIT_FAILURE;
+    }
+    else if (!(p = malloc(n * sizeof *p)))
+    {
+        fprintf(stderr, "%s: malloc(3): %s\n", __func__, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    for (size_t i = 0; i < n; i++)
+        p[i].fd = -1;
+
+    if (pipe(fds))
+    {
+        fprintf(stderr, "%s: pipe(2): %s\n", __func__, strerror(errno));
+        goto end;
+    }
+    else if ((pid = fork()) < 0)
+    {
+        fprintf(stderr, "%s: fork(2): %s\n", __func__, strerror(errno));
+        goto end;
+    }
+    else if (!pid)
+    {
+        close(fds[0]);
+        exit(serve(fds[1]));
+    }
+
+    close(fds[1]);
+    fds[1] = -1;
+
+    if (read(fds[0], &port, sizeof port) != sizeof port)
+    {
+        fprintf(stderr, "%s: server failed to start\n", __func__);
+        goto end;
+    }
+
+    const unsigned long long before = rss(pid);
+
+    if (!before)
+    {
+        fprintf(stderr, "%s: rss failed\n", __func__);
+        goto end;
+    }
+    else if (connect_idle(p, n, port))
+    {
+        fprintf(stderr, "%s: connect_idle failed\n", __func__);
+        goto end;
+    }
+
+    /* Give the server some time to release buffers from the last
+     * requests. */
+    const struct timespec ts = {.tv_nsec = 100 * 1000 * 1000};
+
+    nanosleep(&ts, NULL);
+
+    const unsigned long long after = rss(pid);
+
+    if (!after)
+    {
+        fprintf(stderr, "%s: rss failed\n", __func__);
+        goto end;
+    }
+
+    printf("idle connections: %lu, server RSS: %llu KiB -> %llu KiB, "
+        "%.0f bytes/connection\n", n, before / 1024, after / 1024,
+        ((double)after - before) / n);
+    ret = EXIT_SUCCESS;
+
+end:
+    if (pid > 0 && stop(pid))
+        ret = EXIT_FAILURE;
+
+    for (size_t i = 0; i < sizeof fds / sizeof *fds; i++)
+        if (fds[i] >= 0)
+            close(fds[i]);
+
+    if (p)
+        for (size_t i = 0; i < n; i++)
+            if (p[i].fd >= 0)
+                close(p[i].fd);
+
+    free(p);
+    return ret;
+}
@@ -0,0 +1,334 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <libweb/http.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BOUNDARY "----------------------------735323031399963166993862"
+
+enum {BLOCK = 1024 * 1024};
+
+struct bench
+{
+    const char *name;
+    char *block;
+    /* Request bytes are produced from a list of segments, so that large
+     * bodies do not need to be held in memory. */
+    struct segment
+    {
+        const char *buf;
+        size_t n;
+        unsigned long repeat;
+    } segments[3];
+
+    size_t i, off;
+    unsigned long rep;
+    bool served;
+};
+
+static const char body_head[] =
+    "--" BOUNDARY "\r\n"
+    "Content-Disposition: form-data; name=\"file\"; filename=\"f\"\r\n"
+    "Content-Type: application/octet-stream\r\n"
+    "\r\n";
+
+static const char body_tail[] = "\r\n--" BOUNDARY "--\r\n";
+
+/* Lines starting with "--" look like the start of a boundary, so they
+ * are the worst case for a boundary search. */
+static const char line[] = "\r\n-- some text that is almost a boundary";
+
+static double now(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    {
+        fprintf(stderr, "%s: clock_gettime(2): %s\n", __func__,
+            strerror(errno));
+        return -1;
+    }
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int on_read(void *const buf, const size_t n, void *const user)
+{
+    struct bench *const b = user;
+    size_t r = 0;
+
+    while (r < n && b->i < sizeof b->segments / sizeof *b->segments)
+    {
+        const struct segment *const s = &b->segments[b->i];
+        const size_t rem = s->n - b->off, m = n - r > rem ? rem : n - r;
+
+        memcpy((char *)buf + r, s->buf + b->off, m);
+        r += m;
+
+        if ((b->off += m) == s->n)
+        {
+            b->off = 0;
+
+            if (++b->rep >= s->repeat)
+            {
+                b->rep = 0;
+                b->i++;
+            }
+        }
+    }
+
+    if (!r)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    return r;
+}
+
+static int on_write(const void *const buf, const size_t n, void *const user)
+{
+    return n;
+}
+
+static int on_payload(const struct http_payload *const p,
+    struct http_response *const r, void *const user)
+{
+    struct bench *const b = user;
+
+    for (size_t i = 0; i < p->u.post.nfiles; i++)
+        if (remove(p->u.post.files[i].tmpname))
+            fprintf(stderr, "%s: remove(3) %s: %s\n", __func__,
+                p->u.post.files[i].tmpname, strerror(errno));
+
+    b->served = true;
+
+    *r = (const struct http_response)
+    {
+        .status = p->u.post.nfiles == 1 ? HTTP_STATUS_OK
+            : HTTP_STATUS_BAD_REQUEST
+    };
+
+    return 0;
+}
+
+static int on_length(const unsigned long long len,
+    const struct http_cookie *const c, struct http_response *const r,
+    void *const user)
+{
+    return 0;
+}
+
+/* Returns the time taken to process the whole request, in seconds, or a
+ * negative number on failure. */
+static double measure(struct bench *const b, const char *const tmpdir,
+    const unsigned long mib)
+{
+    double ret = -1;
+    char head[512];
+    const unsigned long long len = sizeof body_head - 1
+        + (unsigned long long)mib * BLOCK + sizeof body_tail - 1;
+    const int n = snprintf(head, sizeof head,
+        "POST /upload HTTP/1.1\r\n"
+        "Content-Type: multipart/form-data; boundary=" BOUNDARY "\r\n"
+        "Content-Length: %llu\r\n"
+        "\r\n"
+        "%s", len, body_head);
+    const struct http_cfg cfg =
+    {
+        .read = on_read,
+        .write = on_write,
+        .payload = on_payload,
+        .length = on_length,
+        .tmpdir = tmpdir,
+        .user = b,
+        .max_headers = 8
+    };
+
+    struct http_ctx *const h = http_alloc(&cfg);
+
+    if (!h)
+    {
+        fprintf(stderr, "%s: http_alloc failed\n", __func__);
+        goto end;
+    }
+    else if (n < 0 || (size_t)n >= sizeof head)
+    {
+        fprintf(stderr, "%s: snprintf(3) failed\n", __func__);
+        goto end;
+    }
+
+    b->segments[0] = (const struct segment){.buf = head, .n = n, .repeat = 1};
+    b->segments[1] = (const struct segment)
+    {
+        .buf = b->block,
+        .n = BLOCK,
+        .repeat = mib
+    };
+
+    b->segments[2] = (const struct segment)
+    {
+        .buf = body_tail,
+        .n = sizeof body_tail - 1,
+        .repeat = 1
+    };
+
+    b->i = b->off = b->rep = 0;
+    b->served = false;
+
+    const double t0 = now();
+
+    while (!b->served)
+    {
+        bool write, close;
+        const int res = http_update(h, &write, &close);
+
+        if (res || close)
+        {
+            fprintf(stderr, "%s: unexpected %s\n", __func__,
+                res ? "error" : "close");
+            goto end;
+        }
+    }
+
+    const double t1 = now();
+
+    if (t0 < 0 || t1 < 0)
+    {
+        fprintf(stderr, "%s: now failed\n", __func__);
+        goto end;
+    }
+
+    ret = t1 - t0;
+
+end:
+    http_free(h);
+    return ret;
+}
+
+/* The best of several rounds is reported, so that results are not
+ * skewed by other processes. */
+static int run(struct bench *const b, const char *const tmpdir,
+    const unsigned long mib, FILE *const out)
+{
+    enum {ROUNDS = 3};
+    double best = -1;
+
+    for (int i = 0; i < ROUNDS; i++)
+    {
+        const double t = measure(b, tmpdir, mib);
+
+        if (t < 0)
+        {
+            fprintf(stderr, "%s: measure failed\n", __func__);
+            return -1;
+        }
+        else if (best < 0 || t < best)
+            best = t;
+    }
+
+    fprintf(out, "%-6s %lu MiB: %.3f s, %.1f MiB/s\n", b->name, mib, best,
+        mib / best);
+    return 0;
+}
+
+static void fill_random(char *const buf, const size_t n)
+{
+    uint32_t x = 2463534242u;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        buf[i] = x;
+    }
+}
+
+static void fill_text(char *const buf, const size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        buf[i] = line[i % (sizeof line - 1)];
+}
+
+int main(int argc, char *argv[])
+{
+    int ret = EXIT_FAILURE;
+    unsigned long mib = 256;
+    const char *tmpdir = "/tmp";
+    struct bench benches[] =
+    {
+        {.name = "random", .block = malloc(BLOCK)},
+        {.name = "text", .block = malloc(BLOCK)}
+    };
+
+    if (argc > 3)
+    {
+        fprintf(stderr, "%s [MiB [tmpdir]]\n", *argv);
+        goto end;
+    }
+    else if (argc > 1)
+    {
+        char *end;
+
+        errno = 0;
+        mib = strtoul(argv[1], &end, 10);
+
+        if (errno || *end || !mib)
+        {
+            fprintf(stderr, "%s: invalid size: %s\n", __func__, argv[1]);
+            goto end;
+        }
+        else if (argc > 2)
+            tmpdir = argv[2];
+    }
+
+    if (!benches[0].block || !benches[1].block)
+    {
+        fprintf(stderr, "%s: malloc(3): %s\n", __func__, strerror(errno));
+        goto end;
+    }
+
+    fill_random(benches[0].block, BLOCK);
+    fill_text(benches[1].block, BLOCK);
+
+    /* Requests are logged to standard output, so results are printed to a
+     * duplicate of it instead. */
+    const int fd = dup(STDOUT_FILENO);
+    FILE *const out = fd >= 0 ? fdopen(fd, "w") : NULL;
+
+    if (!out)
+    {
+        fprintf(stderr, "%s: dup(2)/fdopen(3): %s\n", __func__,
+            strerror(errno));
+        goto end;
+    }
+    else if (!freopen("/dev/null", "w", stdout))
+    {
+        fprintf(stderr, "%s: freopen(3): %s\n", __func__, strerror(errno));
+        goto end;
+    }
+
+    for (size_t i = 0; i < sizeof benches / sizeof *benches; i++)
+        if (run(&benches[i], tmpdir, mib, out))
+        {
+            fprintf(stderr, "%s: run %s failed\n", __func__,
+                benches[i].name);
+            goto end;
+        }
+
+    ret = EXIT_SUCCESS;
+
+end:
+    for (size_t i = 0; i < sizeof benches / sizeof *benches; i++)
+        free(benches[i].block);
+
+    return ret;
+}
@@ -0,0 +1,419 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <libweb/handler.h>
+#include <libweb/http.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct conn
+{
+    unsigned long pending;
+    /* Number of bytes from "\r\n\r\n" matched so far, since responses
+     * might be split across reads. */
+    size_t match;
+};
+
+static const char request[] = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+static const unsigned long depths[] = {1, 4, 16, 64};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    {
+        fprintf(stderr, "%s: clock_gettime(2): %s\n", __func__,
+            strerror(errno));
+        return -1;
+    }
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int hello(const struct http_payload *const pl,
+    struct http_response *const r, void *const user)
+{
+    *r = (const struct http_response)
+    {
+        .status = HTTP_STATUS_OK
+    };
+
+    return 0;
+}
+
+static int serve(const int fd)
+{
+    int ret = EXIT_FAILURE;
+    const struct handler_cfg cfg = {0};
+    struct handler *const h = handler_alloc(&cfg);
+    unsigned short port;
+
+    /* Request lines are logged to standard output. */
+    if (!freopen("/dev/null", "w", stdout))
+    {
+        fprintf(stderr, "%s: freopen(3): %s\n", __func__, strerror(errno));
+        goto end;
+    }
+    else if (!h)
+    {
+        fprintf(stderr, "%s: handler_alloc failed\n", __func__);
+        goto end;
+    }
+    else if (handler_add(h, "/", HTTP_OP_GET, hello, NULL))
+    {
+        fprintf(stderr, "%s: handler_add failed\n", __func__);
+        goto end;
+    }
+    else if (handler_listen(h, 0, &port))
+    {
+        fprintf(stderr, "%s: handler_listen failed\n", __func__);
+        goto end;
+    }
+    else if (write(fd, &port, sizeof port) != sizeof port)
+    {
+        fprintf(stderr, "%s: write(2): %s\n", __func__, strerror(errno));
+        goto end;
+    }
+    else if (close(fd))
+    {
+        fprintf(stderr, "%s: close(2): %s\n", __func__, strerror(errno));
+        goto end;
+    }
+    else if (handler_loop(h))
+    {
+        fprintf(stderr, "%s: handler_loop failed\n", __func__);
+        goto end;
+    }
+
+    ret = EXIT_SUCCESS;
+
+end:
+    handler_free(h);
+    return ret;
+}
+
+/* Sends depth requests at once, without waiting for any response. */
+static int send_batch(const int fd, const char *const buf, const size_t n)
+{
+    for (size_t sent = 0; sent < n;)
+    {
+        const ssize_t w = send(fd, buf + sent, n - sent, 0);
+
+        if (w < 0)
+        {
+            fprintf(stderr, "%s: send(2): %s\n", __func__, strerror(errno));
+            return -1;
+        }
+
+        sent += w;
+    }
+
+    return 0;
+}
+
+/* Returns the number of responses completed by the bytes in buf. Since
+ * responses have no body, each one ends with the first "\r\n\r\n". */
+static unsigned long count(struct conn *const c, const char *const buf,
+    const size_t n)
+{
+    static const char end[] = "\r\n\r\n";
+    unsigned long ret = 0;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        if (buf[i] == end[c->match])
+            c->match++;
+        else
+            c->match = buf[i] == *end;
+
+        if (c->match == sizeof end - 1)
+        {
+            c->match = 0;
+            ret++;
+        }
+    }
+
+    return ret;
+}
+
+static int connect_all(struct pollfd *const fds, const size_t n,
+    const unsigned short port)
+{
+    const struct sockaddr_in addr =
+    {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    };
+
+    for (size_t i = 0; i < n; i++)
+    {
+        const int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+        fds[i] = (const struct pollfd){.fd = fd, .events = POLLIN};
+
+        if (fd < 0)
+        {
+            fprintf(stderr, "%s: socket(2): %s\n", __func__,
+                strerror(errno));
+            return -1;
+        }
+        else if (connect(fd, (const struct sockaddr *)&addr, sizeof addr))
+        {
+            fprintf(stderr, "%s: connect(2): %s\n", __func__,
+                strerror(errno));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Sends n requests over every connection, depth requests at a time, and
+ * returns the number of requests per second, or a negative number on
+ * failure. */
+static double run(const unsigned short port, const size_t n_conn,
+    const unsigned long n, const unsigned long depth)
+{
+    double ret = -1;
+    const size_t len = strlen(request);
+    char *const batch = malloc(len * depth);
+    struct pollfd *const fds = calloc(n_conn, sizeof *fds);
+    struct conn *const c = calloc(n_conn, sizeof *c);
+    unsigned long *const left = calloc(n_conn, sizeof *left);
+    size_t active = n_conn;
+
+    if (fds)
+        for (size_t i = 0; i < n_conn; i++)
+            fds[i].fd = -1;
+
+    if (!batch || !fds || !c || !left)
+    {
+        fprintf(stderr, "%s: malloc(3): %s\n", __func__, strerror(errno));
+        goto end;
+    }
+
+    for (unsigned long i = 0; i < depth; i++)
+        memcpy(batch + i * len, request, len);
+
+    if (connect_all(fds, n_conn, port))
+    {
+        fprintf(stderr, "%s: connect_all failed\n", __func__);
+        goto end;
+    }
+
+    const double t0 = now();
+
+    for (size_t i = 0; i < n_conn; i++)
+    {
+        left[i] = n - depth;
+        c[i].pending = depth;
+
+        if (send_batch(fds[i].fd, batch, len * depth))
+        {
+            fprintf(stderr, "%s: send_batch failed\n", __func__);
+            goto end;
+        }
+    }
+
+    while (active)
+    {
+        if (poll(fds, n_conn, -1) < 0)
+        {
+            fprintf(stderr, "%s: poll(2): %s\n", __func__, strerror(errno));
+            goto end;
+        }
+
+        for (size_t i = 0; i < n_conn; i++)
+        {
+            struct pollfd *const p = &fds[i];
+            struct conn *const cn = &c[i];
+            char buf[BUFSIZ];
+
+            if (!p->revents)
+                continue;
+
+            const ssize_t r = recv(p->fd, buf, sizeof buf, 0);
+
+            if (r <= 0)
+            {
+                fprintf(stderr, "%s: connection %zu closed\n", __func__, i);
+                goto end;
+            }
+            else if ((cn->pending -= count(cn, buf, r)))
+                continue;
+            else if (!left[i])
+            {
+                p->events = 0;
+                active--;
+                continue;
+            }
+
+            cn->pending = depth;
+            left[i] -= depth;
+
+            if (send_batch(p->fd, batch, len * depth))
+            {
+                fprintf(stderr, "%s: send_batch failed\n", __func__);
+                goto end;
+            }
+        }
+    }
+
+    const double t = now() - t0;
+
+    if (t0 < 0 || t < 0)
+    {
+        fprintf(stderr, "%s: now failed\n", __func__);
+        goto end;
+    }
+
+    ret = n * n_conn / t;
+
+end:
+    if (fds)
+        for (size_t i = 0; i < n_conn; i++)
+            if (fds[i].fd >= 0)
+                close(fds[i].fd);
+
+    free(batch);
+    free(fds);
+    free(c);
+    free(left);
+    return ret;
+}
+
+/* The server only notices SIGTERM if it interrupts a wait for events, so
+ * it is sent again until the server exits. */
+static int stop(const pid_t pid)
+{
+    const struct timespec ts = {.tv_nsec = 100 * 1000 * 1000};
+
+    for (;;)
+    {
+        const pid_t w = waitpid(pid, NULL, WNOHANG);
+
+        if (w < 0)
+        {
+            fprintf(stderr, "%s: waitpid(2): %s\n", __func__,
+                strerror(errno));
+            return -1;
+        }
+        else if (w)
+            return 0;
+        else if (kill(pid, SIGTERM))
+        {
+            fprintf(stderr, "%s: kill(2): %s\n", __func__, strerror(errno));
+            return -1;
+        }
+
+        nanosleep(&ts, NULL);
+    }
+}
+
+static int parse(const char *const s, unsigned long *const out)
+{
+    char *end;
+
+    errno = 0;
+    *out = strtoul(s, &end, 10);
+
+    if (errno || *end || !*out)
+    {
+        fprintf(stderr, "%s: invalid number: %s\n", __func__, s);
+        return -1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int ret = EXIT_FAILURE, fds[2] = {-1, -1};
+    /* The number of requests must be a multiple of every depth. */
+    unsigned long n = 64 * 1024, n_conn = 4;
+    unsigned short port;
+    pid_t pid = -1;
+
+    if (argc > 3)
+    {
+        fprintf(stderr, "%s [connections [requests]]\n", *argv);
+        return EXIT_FAILURE;
+    }
+    else if ((argc > 1 && parse(argv[1], &n_conn))
+        || (argc > 2 && parse(argv[2], &n)))
+        return EXIT_FAILURE;
+
+    for (size_t i = 0; i < sizeof depths / sizeof *depths; i++)
+        if (n % depths[i])
+        {
+            fprintf(stderr, "%s: %lu requests not a multiple of %lu\n",
+                __func__, n, depths[i]);
+            return EXIT_FAILURE;
+        }
+
+    if (pipe(fds))
+    {
+        fprintf(stderr, "%s: pipe(2): %s\n", __func__, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    else if ((pid = fork()) < 0)
+    {
+        fprintf(stderr, "%s: fork(2): %s\n", __func__, strerror(errno));
+        goto end;
+    }
+    else if (!pid)
+    {
+        close(fds[0]);
+        exit(serve(fds[1]));
+    }
+
+    close(fds[1]);
+    fds[1] = -1;
+
+    if (read(fds[0], &port, sizeof port) != sizeof port)
+    {
+        fprintf(stderr, "%s: server failed to start\n", __func__);
+        goto end;
+    }
+
+    for (size_t i = 0; i < sizeof depths / sizeof *depths; i++)
+    {
+        const unsigned long depth = depths[i];
+        const double rps = run(port, n_conn, n, depth);
+
+        if (rps < 0)
+        {
+            fprintf(stderr, "%s: run failed\n", __func__);
+            goto end;
+        }
+
+        printf("connections: %lu, depth: %2lu, %.0f requests/s\n",
+            n_conn, depth, rps);
+    }
+
+    ret = EXIT_SUCCESS;
+
+end:
+    if (pid > 0 && stop(pid))
+        ret = EXIT_FAILURE;
+
+    for (size_t i = 0; i < sizeof fds / sizeof *fds; i++)
+        if (fds[i] >= 0)
+            close(fds[i]);
+
+    return ret;
+}
@@ -0,0 +1,254 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <libweb/http.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct bench
+{
+    const char *name, *request;
+    size_t len, off;
+    unsigned long served;
+};
+
+static const char small[] =
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "Accept: */*\r\n"
+    "\r\n";
+
+static const char browser[] =
+    "GET /static/v2/img/icons/logo.png?size=large&theme=dark HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) "
+        "Gecko/20100101 Firefox/128.0\r\n"
+    "Accept: image/avif,image/webp,image/png,image/svg+xml,image/*;"
+        "q=0.8,*/*;q=0.5\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Referer: https://www.example.com/some/page/that/links/the/logo\r\n"
+    "Connection: keep-alive\r\n"
+    "Cookie: session=2f9a4c7e1b3d5f8a0c2e4b6d8f1a3c5e7b9d0f2a4c6e8b1d3f5a7c9e;"
+        " theme=dark; lang=en-US\r\n"
+    "Sec-Fetch-Dest: image\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Priority: u=5, i\r\n"
+    "Pragma: no-cache\r\n"
+    "Cache-Control: no-cache\r\n"
+    "\r\n";
+
+static double now(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    {
+        fprintf(stderr, "%s: clock_gettime(2): %s\n", __func__,
+            strerror(errno));
+        return -1;
+    }
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Only one request is made available at a time, as with a keep-alive
+ * client waiting for every response, so that pipelining does not affect
+ * the results. */
+static int on_read(void *const buf, const size_t n, void *const user)
+{
+    struct bench *const b = user;
+    const size_t rem = b->len - b->off;
+
+    if (!rem)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    const size_t r = n > rem ? rem : n;
+
+    memcpy(buf, b->request + b->off, r);
+    b->off += r;
+    return r;
+}
+
+static int on_write(const void *const buf, const size_t n, void *const user)
+{
+    return n;
+}
+
+static int on_payload(const struct http_payload *const p,
+    struct http_response *const r, void *const user)
+{
+    struct bench *const b = user;
+
+    b->served++;
+    b->off = 0;
+
+    *r = (const struct http_response)
+    {
+        .status = HTTP_STATUS_OK
+    };
+
+    return 0;
+}
+
+static int on_length(const unsigned long long len,
+    const struct http_cookie *const c, struct http_response *const r,
+    void *const user)
+{
+    *r = (const struct http_response)
+    {
+        .status = HTTP_STATUS_FORBIDDEN
+    };
+
+    return 1;
+}
+
+/* Returns the time taken to serve n requests, in nanoseconds, or a
+ * negative number on failure. */
+static double measure(struct bench *const b, const unsigned long n)
+{
+    double ret = -1;
+    const struct http_cfg cfg =
+    {
+        .read = on_read,
+        .write = on_write,
+        .payload = on_payload,
+        .length = on_length,
+        .user = b,
+        .max_headers = 32
+    };
+
+    struct http_ctx *const h = http_alloc(&cfg);
+
+    b->off = b->served = 0;
+
+    if (!h)
+    {
+        fprintf(stderr, "%s: http_alloc failed\n", __func__);
+        goto end;
+    }
+
+    const double t0 = now();
+
+    for (;;)
+    {
+        bool write, close;
+        const int res = http_update(h, &write, &close);
+
+        if (res || close)
+        {
+            fprintf(stderr, "%s: unexpected %s\n", __func__,
+                res ? "error" : "close");
+            goto end;
+        }
+        else if (!write && b->served >= n)
+            break;
+    }
+
+    const double t1 = now();
+
+    if (t0 < 0 || t1 < 0)
+    {
+        fprintf(stderr, "%s: now failed\n", __func__);
+        goto end;
+    }
+
+    ret = t1 - t0;
+
+end:
+    http_free(h);
+    return ret;
+}
+
+/* The best of several rounds is reported, so that results are not
+ * skewed by other processes. */
+static int run(struct bench *const b, const unsigned long n,
+    FILE *const out)
+{
+    enum {ROUNDS = 5};
+    double best = -1;
+
+    for (int i = 0; i < ROUNDS; i++)
+    {
+        const double t = measure(b, n);
+
+        if (t < 0)
+        {
+            fprintf(stderr, "%s: measure failed\n", __func__);
+            return -1;
+        }
+        else if (best < 0 || t < best)
+            best = t;
+    }
+
+    fprintf(out, "%-8s %4zu bytes/request: %8.1f ns/request, "
+        "%7.1f MiB/s\n", b->name, b->len, best / n,
+        b->len * n / (best / 1e9) / (1024 * 1024));
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long n = 200000;
+
+    if (argc > 2)
+    {
+        fprintf(stderr, "%s [requests]\n", *argv);
+        return EXIT_FAILURE;
+    }
+    else if (argc == 2)
+    {
+        char *end;
+
+        errno = 0;
+        n = strtoul(argv[1], &end, 10);
+
+        if (errno || *end || !n)
+        {
+            fprintf(stderr, "%s: invalid number of requests: %s\n",
+                __func__, argv[1]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* Requests are logged to standard output, so results are printed to a
+     * duplicate of it instead. */
+    const int fd = dup(STDOUT_FILENO);
+    FILE *const out = fd >= 0 ? fdopen(fd, "w") : NULL;
+
+    if (!out)
+    {
+        fprintf(stderr, "%s: dup(2)/fdopen(3): %s\n", __func__,
+            strerror(errno));
+        return EXIT_FAILURE;
+    }
+    else if (!freopen("/dev/null", "w", stdout))
+    {
+        fprintf(stderr, "%s: freopen(3): %s\n", __func__, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    struct bench benches[] =
+    {
+        {.name = "small", .request = small, .len = sizeof small - 1},
+        {.name = "browser", .request = browser, .len = sizeof browser - 1}
+    };
+
+    for (size_t i = 0; i < sizeof benches / sizeof *benches; i++)
+        if (run(&benches[i], n, out))
+        {
+            fprintf(stderr, "%s: run %s failed\n", __func__, benches[i].name);
+            return EXIT_FAILURE;
+        }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,525 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <libweb/handler.h>
+#include <libweb/http.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BOUNDARY "----------------------------735323031399963166993862"
+
+enum {BLOCK = 1024 * 1024};
+
+struct mode
+{
+    const char *name, *request;
+    bool multipart;
+};
+
+static const char body_head[] =
+    "--" BOUNDARY "\r\n"
+    "Content-Disposition: form-data; name=\"file\"; filename=\"f\"\r\n"
+    "Content-Type: application/octet-stream\r\n"
+    "\r\n";
+
+static const char body_tail[] = "\r\n--" BOUNDARY "--\r\n";
+
+static const struct mode modes[] =
+{
+    {
+        .name = "multipart",
+        .request = "POST /form HTTP/1.1\r\n"
+            "Content-Type: multipart/form-data; boundary=" BOUNDARY "\r\n",
+        .multipart = true
+    },
+
+    {
+        .name = "put",
+        .request = "PUT /put HTTP/1.1\r\n"
+    },
+
+    {
+        .name = "stream",
+        .request = "POST /stream HTTP/1.1\r\n"
+    }
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    {
+        fprintf(stderr, "%s: clock_gettime(2): %s\n", __func__,
+            strerror(errno));
+        return -1;
+    }
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int form(const struct http_payload *const p,
+    struct http_response *const r, void *const user)
+{
+    for (size_t i = 0; i < p->u.post.nfiles; i++)
+        if (remove(p->u.post.files[i].tmpname))
+            fprintf(stderr, "%s: remove(3) %s: %s\n", __func__,
+                p->u.post.files[i].tmpname, strerror(errno));
+
+    *r = (const struct http_response)
+    {
+        .status = p->u.post.nfiles == 1 ? HTTP_STATUS_OK
+            : HTTP_STATUS_BAD_REQUEST
+    };
+
+    return 0;
+}
+
+static int put(const struct http_payload *const p,
+    struct http_response *const r, void *const user)
+{
+    if (remove(p->u.put.tmpname))
+        fprintf(stderr, "%s: remove(3) %s: %s\n", __func__,
+            p->u.put.tmpname, strerror(errno));
+
+    *r = (const struct http_response)
+    {
+        .status = HTTP_STATUS_OK
+    };
+
+    return 0;
+}
+
+/* Data is discarded as it arrives, so no file is written. */
+static int stream(const struct http_payload *const p,
+    struct http_response *const r, void *const user)
+{
+    if (!p->stream->last)
+        return 0;
+
+    *r = (const struct http_response)
+    {
+        .status = HTTP_STATUS_OK
+    };
+
+    return 0;
+}
+
+static int length(const unsigned long long len,
+    const struct http_cookie *const c, struct http_response *const r,
+    void *const user)
+{
+    return 0;
+}
+
+static int serve(const char *const tmpdir, const int fd)
+{
+    int ret = EXIT_FAILURE;
+    const struct handler_cfg cfg =
+    {
+        .tmpdir = tmpdir,
+        .length = length,
+        .max_headers = 8
+    };
+
+    struct handler *const h = handler_alloc(&cfg);
+    unsigned short port;
+
+    /* Request lines are logged to standard output. */
+    if (!freopen("/dev/null", "w", stdout))
+    {
+        fprintf(stderr, "%s: freopen(3): %s\n", __func__, strerror(errno));
+        goto end;
+    }
+    else if (!h)
+    {
+        fprintf(stderr, "%s: handler_alloc failed\n", __func__);
+        goto end;
+    }
+    else if (handler_add(h, "/form", HTTP_OP_POST, form, NULL)
+        || handler_add(h, "/put", HTTP_OP_PUT, put, NULL)
+        || handler_add_stream(h, "/stream", HTTP_OP_POST, stream, NULL))
+    {
+        fprintf(stderr, "%s: handler_add failed\n", __func__);
+        goto end;
+    }
+    else if (handler_listen(h, 0, &port))
+    {
+        fprintf(stderr, "%s: handler_listen failed\n", __func__);
+        goto end;
+    }
+    else if (write(fd, &port, sizeof port) != sizeof port)
+    {
+        fprintf(stderr, "%s: write(2): %s\n", __func__, strerror(errno));
+        goto end;
+    }
+    else if (close(fd))
+    {
+        fprintf(stderr, "%s: close(2): %s\n", __func__, strerror(errno));
+        goto end;
+    }
+    else if (handler_loop(h))
+    {
+        fprintf(stderr, "%s: handler_loop failed\n", __func__);
+        goto end;
+    }
+
+    ret = EXIT_SUCCESS;
+
+end:
+    handler_free(h);
+    return ret;
+}
+
+/* Returns the CPU time consumed so far by a process, in seconds, or a
+ * negative number on failure. */
+static double cpu(const pid_t pid)
+{
+    double ret = -1;
+    char path[sizeof "/proc//stat" + 3 * sizeof pid], buf[1024];
+    unsigned long utime, stime;
+    const long tck = sysconf(_SC_CLK_TCK);
+    FILE *f = NULL;
+    const char *s;
+
+    snprintf(path, sizeof path, "/proc/%ld/stat", (long)pid);
+
+    if (tck <= 0)
+    {
+        fprintf(stderr, "%s: sysconf(3): %s\n", __func__, strerror(errno));
+        goto end;
+    }
+    else if (!(f = fopen(path, "rb")))
+    {
+        fprintf(stderr, "%s: fopen(3) %s: %s\n", __func__, path,
+            strerror(errno));
+        goto end;
+    }
+    else if (!fgets(buf, sizeof buf, f))
+    {
+        fprintf(stderr, "%s: failed to read %s\n", __func__, path);
+        goto end;
+    }
+    /* The process name might contain spaces, so fields are counted from
+     * the last parenthesis. utime and stime are fields 14 and 15. */
+    else if (!(s = strrchr(buf, ')'))
+        || sscanf(s + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+            "%lu %lu", &utime, &stime) != 2)
+    {
+        fprintf(stderr, "%s: failed to parse %s\n", __func__, path);
+        goto end;
+    }
+
+    ret = (double)(utime + stime) / tck;
+
+end:
+    if (f && fclose(f))
+        fprintf(stderr, "%s: fclose(3): %s\n", __func__, strerror(errno));
+
+    return ret;
+}
+
+static int send_all(const int fd, const void *const buf, const size_t n)
+{
+    for (size_t sent = 0; sent < n;)
+    {
+        const ssize_t w = send(fd, (const char *)buf + sent, n - sent, 0);
+
+        if (w < 0)
+        {
+            fprintf(stderr, "%s: send(2): %s\n", __func__, strerror(errno));
+            return -1;
+        }
+
+        sent += w;
+    }
+
+    return 0;
+}
+
+static int check_response(const int fd)
+{
+    char buf[256];
+    size_t n = 0;
+
+    while (n < sizeof buf - 1)
+    {
+        const ssize_t r = recv(fd, buf + n, sizeof buf - n - 1, 0);
+
+        if (r < 0)
+        {
+            fprintf(stderr, "%s: recv(2): %s\n", __func__, strerror(errno));
+            return -1;
+        }
+        else if (!r)
+            break;
+
+        n += r;
+        buf[n] = '\0';
+
+        if (strstr(buf, "\r\n\r\n"))
+        {
+            if (strncmp(buf, "HTTP/1.1 200", strlen("HTTP/1.1 200")))
+                break;
+
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "%s: unexpected response\n", __func__);
+    return -1;
+}
+
+/* Uploads mib MiB to the server and stores the time taken and the CPU
+ * time consumed by the server, in seconds. */
+static int upload(const struct mode *const m, const unsigned short port,
+    const pid_t pid, const char *const block, const unsigned long mib,
+    double *const t, double *const c)
+{
+    int ret = -1;
+    char head[512];
+    const unsigned long long len = (unsigned long long)mib * BLOCK
+        + (m->multipart ? sizeof body_head - 1 + sizeof body_tail - 1 : 0);
+    const int n = snprintf(head, sizeof head, "%s"
+        "Content-Length: %llu\r\n"
+        "\r\n"
+        "%s", m->request, len, m->multipart ? body_head : "");
+    const struct sockaddr_in addr =
+    {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    };
+
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (n < 0 || (size_t)n >= sizeof head)
+    {
+        fprintf(stderr, "%s: snprintf(3) failed\n", __func__);
+        goto end;
+    }
+    else if (fd < 0)
+    {
+        fprintf(stderr, "%s: socket(2): %s\n", __func__, strerror(errno));
+        goto end;
+    }
+    else if (connect(fd, (const struct sockaddr *)&addr, sizeof addr))
+    {
+        fprintf(stderr, "%s: connect(2): %s\n", __func__, strerror(errno));
+        goto end;
+    }
+
+    const double t0 = now(), c0 = cpu(pid);
+
+    if (send_all(fd, head, n))
+    {
+        fprintf(stderr, "%s: send_all failed\n", __func__);
+        goto end;
+    }
+
+    for (unsigned long i = 0; i < mib; i++)
+        if (send_all(fd, block, BLOCK))
+        {
+            fprintf(stderr, "%s: send_all failed\n", __func__);
+            goto end;
+        }
+
+    if (m->multipart && send_all(fd, body_tail, sizeof body_tail - 1))
+    {
+        fprintf(stderr, "%s: send_all failed\n", __func__);
+        goto end;
+    }
+    else if (check_response(fd))
+    {
+        fprintf(stderr, "%s: check_response failed\n", __func__);
+        goto end;
+    }
+
+    const double t1 = now(), c1 = cpu(pid);
+
+    if (t0 < 0 || t1 < 0 || c0 < 0 || c1 < 0)
+    {
+        fprintf(stderr, "%s: now/cpu failed\n", __func__);
+        goto end;
+    }
+
+    *t = t1 - t0;
+    *c = c1 - c0;
+    ret = 0;
+
+end:
+    if (fd >= 0 && close(fd))
+    {
+        fprintf(stderr, "%s: close(2): %s\n", __func__, strerror(errno));
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/* The best of several rounds is reported, so that results are not
+ * skewed by other processes. */
+static int run(const struct mode *const m, const unsigned short port,
+    const pid_t pid, const char *const block, const unsigned long mib)
+{
+    enum {ROUNDS = 3};
+    double best_t = -1, best_c = -1;
+
+    for (int i = 0; i < ROUNDS; i++)
+    {
+        double t, c;
+
+        if (upload(m, port, pid, block, mib, &t, &c))
+        {
+            fprintf(stderr, "%s: upload failed\n", __func__);
+            return -1;
+        }
+
+        if (best_t < 0 || t < best_t)
+            best_t = t;
+
+        if (best_c < 0 || c < best_c)
+            best_c = c;
+    }
+
+    printf("%-9s %lu MiB: %.3f s, %.1f MiB/s, server CPU time: %.2f s\n",
+        m->name, mib, best_t, mib / best_t, best_c);
+    return 0;
+}
+
+static void fill_random(char *const buf, const size_t n)
+{
+    uint32_t x = 2463534242u;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        buf[i] = x;
+    }
+}
+
+/* The server only notices SIGTERM if it interrupts a wait for events, so
+ * it is sent again until the server exits. */
+static int stop(const pid_t pid)
+{
+    const struct timespec ts = {.tv_nsec = 100 * 1000 * 1000};
+
+    for (;;)
+    {
+        const pid_t w = waitpid(pid, NULL, WNOHANG);
+
+        if (w < 0)
+        {
+            fprintf(stderr, "%s: waitpid(2): %s\n", __func__,
+                strerror(errno));
+            return -1;
+        }
+        else if (w)
+            return 0;
+        else if (kill(pid, SIGTERM))
+        {
+            fprintf(stderr, "%s: kill(2): %s\n", __func__, strerror(errno));
+            return -1;
+        }
+
+        nanosleep(&ts, NULL);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int ret = EXIT_FAILURE, fds[2] = {-1, -1};
+    unsigned long mib = 256;
+    const char *tmpdir = "/tmp";
+    unsigned short port;
+    pid_t pid = -1;
+    char *const block = malloc(BLOCK);
+
+    if (argc > 3)
+    {
+        fprintf(stderr, "%s [MiB [tmpdir]]\n", *argv);
+        goto end;
+    }
+    else if (argc > 1)
+    {
+        char *end;
+
+        errno = 0;
+        mib = strtoul(argv[1], &end, 10);
+
+        if (errno || *end || !mib)
+        {
+            fprintf(stderr, "%s: invalid size: %s\n", __func__, argv[1]);
+            goto end;
+        }
+        else if (argc > 2)
+            tmpdir = argv[2];
+    }
+
+    if (!block)
+    {
+        fprintf(stderr, "%s: malloc(3): %s\n", __func__, strerror(errno));
+        goto end;
+    }
+
+    fill_random(block, BLOCK);
+
+    if (pipe(fds))
+    {
+        fprintf(stderr, "%s: pipe(2): %s\n", __func__, strerror(errno));
+        goto end;
+    }
+    else if ((pid = fork()) < 0)
+    {
+        fprintf(stderr, "%s: fork(2): %s\n", __func__, strerror(errno));
+        goto end;
+    }
+    else if (!pid)
+    {
+        close(fds[0]);
+        exit(serve(tmpdir, fds[1]));
+    }
+
+    close(fds[1]);
+    fds[1] = -1;
+
+    if (read(fds[0], &port, sizeof port) != sizeof port)
+    {
+        fprintf(stderr, "%s: server failed to start\n", __func__);
+        goto end;
+    }
+
+    for (size_t i = 0; i < sizeof modes / sizeof *modes; i++)
+        if (run(&modes[i], port, pid, block, mib))
+        {
+            fprintf(stderr, "%s: run %s failed\n", __func__, modes[i].name);
+            goto end;
+        }
+
+    ret = EXIT_SUCCESS;
+
+end:
+    if (pid > 0 && stop(pid))
+        ret = EXIT_FAILURE;
+
+    for (size_t i = 0; i < sizeof fds / sizeof *fds; i++)
+        if (fds[i] >= 0)
+            close(fds[i]);
+
+    free(block);
+    return ret;
+}
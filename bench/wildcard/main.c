@@ -0,0 +1,186 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <libweb/wildcard_cmp.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct bench
+{
+    const char *name;
+    const char *const *patterns, *const *resources;
+    size_t n_patterns, n_resources;
+};
+
+static const char *const patterns[] =
+{
+    "/static/*.css",
+    "/static/*/img/*.png",
+    "/api/*/users/*",
+    "/user/*/profile",
+    "/index.html"
+};
+
+static const char *const failing[] =
+{
+    "/favicon.ico",
+    "/download/some/long/path/to/a/file/that/is/never/routed.tar.gz",
+    "/robots.txt",
+    "/.well-known/security.txt"
+};
+
+static const char *const matching[] =
+{
+    "/static/theme/dark/main.css",
+    "/static/v2/img/icons/logo.png",
+    "/api/v1/users/1234567890",
+    "/user/someone/profile"
+};
+
+static const char *const backtrack_patterns[] =
+{
+    "*ab*ab*ab*ac*"
+};
+
+static char backtrack_resource[4096];
+
+static const char *const backtrack[] =
+{
+    backtrack_resource
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    {
+        fprintf(stderr, "%s: clock_gettime(2): %s\n", __func__,
+            strerror(errno));
+        return -1;
+    }
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int run(const struct bench *const b, const unsigned long iter)
+{
+    int ret = -1;
+    const size_t n = b->n_patterns;
+    struct wildcard **const w = calloc(n, sizeof *w);
+    size_t *const len = calloc(b->n_resources, sizeof *len);
+    unsigned long matches = 0;
+
+    if (!w || !len)
+    {
+        fprintf(stderr, "%s: calloc(3): %s\n", __func__, strerror(errno));
+        goto end;
+    }
+
+    for (size_t i = 0; i < n; i++)
+        if (!(w[i] = wildcard_compile(b->patterns[i], true)))
+        {
+            fprintf(stderr, "%s: wildcard_compile failed\n", __func__);
+            goto end;
+        }
+
+    for (size_t i = 0; i < b->n_resources; i++)
+        len[i] = strlen(b->resources[i]);
+
+    const double calls = (double)iter * n * b->n_resources,
+        t0 = now();
+
+    for (unsigned long i = 0; i < iter; i++)
+        for (size_t j = 0; j < b->n_resources; j++)
+            for (size_t k = 0; k < n; k++)
+                matches += !wildcard_cmp(b->resources[j], b->patterns[k],
+                    true);
+
+    const double t1 = now();
+
+    for (unsigned long i = 0; i < iter; i++)
+        for (size_t j = 0; j < b->n_resources; j++)
+            for (size_t k = 0; k < n; k++)
+                matches += !wildcard_match(w[k], b->resources[j], len[j]);
+
+    const double t2 = now();
+
+    if (t0 < 0 || t1 < 0 || t2 < 0)
+    {
+        fprintf(stderr, "%s: now failed\n", __func__);
+        goto end;
+    }
+
+    printf("%-10s wildcard_cmp: %8.2f ns/call, "
+        "wildcard_match: %8.2f ns/call, matches: %lu\n",
+        b->name, (t1 - t0) / calls, (t2 - t1) / calls, matches);
+    ret = 0;
+
+end:
+
+    if (w)
+        for (size_t i = 0; i < n; i++)
+            wildcard_free(w[i]);
+
+    free(w);
+    free(len);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long iter = 1000000;
+
+    if (argc > 2)
+    {
+        fprintf(stderr, "%s [iterations]\n", *argv);
+        return EXIT_FAILURE;
+    }
+    else if (argc == 2)
+    {
+        char *end;
+
+        errno = 0;
+        iter = strtoul(argv[1], &end, 10);
+
+        if (errno || *end || !iter)
+        {
+            fprintf(stderr, "%s: invalid number of iterations: %s\n",
+                __func__, argv[1]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (size_t i = 0; i < sizeof backtrack_resource - 1; i++)
+        backtrack_resource[i] = i % 2 ? 'b' : 'a';
+
+#define BENCH(name, p, r) \
+    {name, p, r, sizeof p / sizeof *p, sizeof r / sizeof *r}
+
+    static const struct bench benches[] =
+    {
+        BENCH("fast-fail", patterns, failing),
+        BENCH("match", patterns, matching),
+        BENCH("backtrack", backtrack_patterns, backtrack)
+    };
+
+    for (size_t i = 0; i < sizeof benches / sizeof *benches; i++)
+    {
+        const struct bench *const b = &benches[i];
+        /* The backtracking case scans resources 1000 times longer. */
+        const unsigned long n = b->resources == backtrack ?
+            iter / 1000 + 1 : iter;
+
+        if (run(b, n))
+        {
+            fprintf(stderr, "%s: run %s failed\n", __func__, b->name);
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
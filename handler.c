@@ -2,38 +2,67 @@
 
 #include "libweb/handler.h"
 #include "libweb/http.h"
+#include "libweb/router.h"
 #include "libweb/server.h"
-#include "libweb/wildcard_cmp.h"
+#include "libweb/wheel.h"
+#include <pthread.h>
 #include <errno.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 struct handler
 {
     struct handler_cfg cfg;
     struct elem
     {
-        char *url;
-        enum http_op op;
         handler_fn f;
         void *user;
+        bool stream;
+        struct elem *next;
     } *elem;
 
-    struct server *server;
-    struct client
+    /* One router per enum http_op, whose routes point to elem. */
+    struct router *routers[HTTP_OP_PUT + 1];
+
+    /* Each worker owns its own listener and clients, so that no locks
+     * are needed. The rest of struct handler is read-only while
+     * handler_loop is running. */
+    struct worker
     {
         struct handler *h;
-        struct server_client *c;
-        struct http_ctx *http;
-        struct client *next;
-    } *clients;
+        struct server *server;
+        struct wheel *wheel;
+        struct http_pool *pool;
+        pthread_t thread;
+        int ret;
 
-    size_t n_cfg;
+        struct client
+        {
+            struct worker *w;
+            struct server_client *c;
+            struct http_ctx *http;
+            struct wheel_timer timer;
+            enum http_phase phase;
+            struct client *prev, *next;
+        } *clients, *spare;
+
+        /* Closed clients are kept into spare, along with their struct
+         * http_ctx, so that new connections reuse them. */
+        size_t n_spare;
+    } *workers;
+
+    size_t n_workers;
 };
 
+/* Default maximum number of spare objects of each kind kept by each
+ * worker, so that memory is given back to the system after a burst. */
+enum {POOL_MAX = 64};
+
 static int on_read(void *const buf, const size_t n, void *const user)
 {
     struct client *const c = user;
@@ -48,19 +77,39 @@ static int on_write(const void *const buf, const size_t n, void *const user)
     return server_write(buf, n, c->c);
 }
 
+static int on_writev(const struct iovec *const iov, const int n,
+    void *const user)
+{
+    struct client *const c = user;
+
+    return server_writev(iov, n, c->c);
+}
+
+static int on_sendfile(const int fd, const off_t offset, const size_t n,
+    void *const user)
+{
+    struct client *const c = user;
+
+    return server_sendfile(fd, offset, n, c->c);
+}
+
+static int on_splice(const int fd, const off_t offset, const size_t n,
+    void *const user)
+{
+    struct client *const c = user;
+
+    return server_splice(fd, offset, n, c->w->server, c->c);
+}
+
 static int on_payload(const struct http_payload *const p,
     struct http_response *const r, void *const user)
 {
     struct client *const c = user;
-    struct handler *const h = c->h;
+    const struct handler *const h = c->w->h;
+    const struct elem *const e = router_match(h->routers[p->op], p->resource);
 
-    for (size_t i = 0; i < h->n_cfg; i++)
-    {
-        const struct elem *const e = &h->elem[i];
-
-        if (e->op == p->op && !wildcard_cmp(p->resource, e->url, true))
-            return e->f(p, r, e->user);
-    }
+    if (e)
+        return e->f(p, r, e->user);
 
     fprintf(stderr, "Not found: %s\n", p->resource);
 
@@ -72,12 +121,21 @@ static int on_payload(const struct http_payload *const p,
     return 0;
 }
 
+static bool on_stream(const struct http_payload *const p, void *const user)
+{
+    const struct client *const c = user;
+    const struct handler *const h = c->w->h;
+    const struct elem *const e = router_match(h->routers[p->op], p->resource);
+
+    return e && e->stream;
+}
+
 static int on_length(const unsigned long long len,
     const struct http_cookie *const c, struct http_response *const r,
     void *const user)
 {
     struct client *const cl = user;
-    struct handler *const h = cl->h;
+    const struct handler *const h = cl->w->h;
 
     if (h->cfg.length)
         return h->cfg.length(len, c, r, h->cfg.user);
@@ -85,15 +143,22 @@ static int on_length(const unsigned long long len,
     return 0;
 }
 
-static struct client *find_or_alloc_client(struct handler *const h,
-    struct server_client *const c)
+static void client_free(struct client *const c)
 {
-    for (struct client *cl = h->clients; cl; cl = cl->next)
-    {
-        if (cl->c == c)
-            return cl;
-    }
+    if (c)
+        http_free(c->http);
 
+    free(c);
+}
+
+static size_t pool_max(const struct handler *const h)
+{
+    return h->cfg.pool_max ? h->cfg.pool_max : POOL_MAX;
+}
+
+static struct client *new_client(struct worker *const w)
+{
+    const struct handler *const h = w->h;
     struct client *const ret = malloc(sizeof *ret);
 
     if (!ret)
@@ -106,150 +171,498 @@ static struct client *find_or_alloc_client(struct handler *const h,
     {
         .read = on_read,
         .write = on_write,
+        .writev = on_writev,
+        .sendfile = on_sendfile,
+        .splice = on_splice,
         .payload = on_payload,
         .length = on_length,
+        .stream = on_stream,
         .user = ret,
         .tmpdir = h->cfg.tmpdir,
-        .max_headers = h->cfg.max_headers
+        .max_headers = h->cfg.max_headers,
+        .arena_chunk = h->cfg.arena_chunk,
+        .read_size = h->cfg.read_size,
+        .max_field = h->cfg.max_field,
+        .anon_tmp = h->cfg.anon_tmp,
+        .spill_fields = h->cfg.spill_fields,
+        .pool = w->pool
     };
 
     *ret = (const struct client)
     {
-        .c = c,
-        .h = h,
-        .http = http_alloc(&cfg)
+        .w = w,
+        .http = http_alloc(&cfg),
+        .timer.user = ret
     };
 
     if (!ret->http)
     {
         fprintf(stderr, "%s: http_alloc failed\n", __func__);
+        client_free(ret);
         return NULL;
     }
 
-    if (!h->clients)
-        h->clients = ret;
+    return ret;
+}
+
+static void put_client(struct worker *const w, struct client *const c)
+{
+    if (w->n_spare < pool_max(w->h))
+    {
+        http_reset(c->http);
+        c->next = w->spare;
+        w->spare = c;
+        w->n_spare++;
+    }
     else
+        client_free(c);
+}
+
+static struct client *alloc_client(struct worker *const w,
+    struct server_client *const c)
+{
+    struct client *ret = w->spare;
+
+    if (ret)
     {
-        for (struct client *c = h->clients; c; c = c->next)
-            if (!c->next)
-            {
-                c->next = ret;
-                break;
-            }
+        w->spare = ret->next;
+        w->n_spare--;
     }
+    else if (!(ret = new_client(w)))
+    {
+        fprintf(stderr, "%s: new_client failed\n", __func__);
+        return NULL;
+    }
+
+    ret->c = c;
+    ret->phase = HTTP_PHASE_IDLE;
+    ret->prev = NULL;
+    ret->next = w->clients;
+
+    if (w->clients)
+        w->clients->prev = ret;
 
+    w->clients = ret;
+    server_client_set_user(c, ret);
     return ret;
 }
 
-static void client_free(struct client *const c)
+static struct client *find_or_alloc_client(struct worker *const w,
+    struct server_client *const c)
 {
-    if (c)
-        http_free(c->http);
+    struct client *const ret = server_client_get_user(c);
 
-    free(c);
+    return ret ? ret : alloc_client(w, c);
 }
 
-static int remove_client_from_list(struct handler *const h,
+static int remove_client_from_list(struct worker *const w,
     struct client *const c)
 {
     int ret = 0;
 
-    if (server_client_close(h->server, c->c))
+    if (server_client_close(w->server, c->c))
     {
         fprintf(stderr, "%s: server_client_close failed\n",
             __func__);
         ret = -1;
     }
 
-    for (struct client *cl = h->clients, *prev = NULL; cl;
-        prev = cl, cl = cl->next)
+    wheel_remove(w->wheel, &c->timer);
+
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        w->clients = c->next;
+
+    if (c->next)
+        c->next->prev = c->prev;
+
+    put_client(w, c);
+    return ret;
+}
+
+static int get_time(unsigned long long *const now)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts))
     {
-        if (cl == c)
-        {
-            if (!prev)
-                h->clients = c->next;
-            else
-                prev->next = cl->next;
+        fprintf(stderr, "%s: clock_gettime(2): %s\n",
+            __func__, strerror(errno));
+        return -1;
+    }
 
-            break;
+    *now = ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+    return 0;
+}
+
+static int warm_clients(struct worker *const w, const size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        struct client *const c = new_client(w);
+
+        if (!c)
+        {
+            fprintf(stderr, "%s: new_client failed\n", __func__);
+            return -1;
         }
+
+        c->next = w->spare;
+        w->spare = c;
+        w->n_spare++;
     }
 
-    client_free(c);
-    return ret;
+    return 0;
 }
 
 int handler_listen(struct handler *const h, const unsigned short port,
     unsigned short *const outport)
 {
-    if (!(h->server = server_init(port, outport)))
+    const size_t n = h->cfg.workers ? h->cfg.workers : 1;
+
+    if (!(h->workers = calloc(n, sizeof *h->workers)))
     {
-        fprintf(stderr, "%s: server_init failed\n", __func__);
+        fprintf(stderr, "%s: calloc(3): %s\n", __func__, strerror(errno));
         return -1;
     }
 
+    h->n_workers = n;
+
+    const size_t max = pool_max(h),
+        warm = h->cfg.pool_warm < max ? h->cfg.pool_warm : max;
+    struct server_cfg cfg =
+    {
+        .port = port,
+        .reuseport = n > 1,
+        .backlog = h->cfg.backlog,
+        .pool_warm = warm,
+        .pool_max = max,
+        .max_accept = h->cfg.max_accept
+    };
+
+    unsigned long long now;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        struct worker *const w = &h->workers[i];
+
+        w->h = h;
+
+        /* Other workers must listen on the same port as the first one,
+         * even if it was randomly assigned. */
+        if (!(w->server = server_init(&cfg, &cfg.port)))
+        {
+            fprintf(stderr, "%s: server_init failed\n", __func__);
+            return -1;
+        }
+        else if (get_time(&now))
+        {
+            fprintf(stderr, "%s: get_time failed\n", __func__);
+            return -1;
+        }
+        else if (!(w->wheel = wheel_alloc(now)))
+        {
+            fprintf(stderr, "%s: wheel_alloc failed\n", __func__);
+            return -1;
+        }
+        else if (!(w->pool = http_pool_alloc(max)))
+        {
+            fprintf(stderr, "%s: http_pool_alloc failed\n", __func__);
+            return -1;
+        }
+        else if (warm_clients(w, warm))
+        {
+            fprintf(stderr, "%s: warm_clients failed\n", __func__);
+            return -1;
+        }
+    }
+
+    if (outport)
+        *outport = cfg.port;
+
     return 0;
 }
 
-int handler_loop(struct handler *const h)
+static void update_timer(struct worker *const w, struct client *const c,
+    const unsigned long long now)
 {
-    for (;;)
+    const struct handler_cfg *const cfg = &w->h->cfg;
+    const enum http_phase phase = http_phase(c->http);
+    unsigned timeout = 0;
+
+    /* The header timeout is a deadline for the whole request header,
+     * so that clients cannot keep a connection open by sending a few
+     * bytes at a time. Other timeouts are reset on every event. */
+    if (phase == HTTP_PHASE_HEADER && c->phase == phase && c->timer.armed)
+        return;
+
+    switch (c->phase = phase)
     {
-        bool exit, io;
-        struct server_client *const c = server_poll(h->server, &io, &exit);
+        case HTTP_PHASE_IDLE:
+            timeout = cfg->idle_timeout;
+            break;
 
-        if (exit)
-        {
-            printf("Exiting...\n");
+        case HTTP_PHASE_HEADER:
+            timeout = cfg->header_timeout;
+            break;
+
+        case HTTP_PHASE_BODY:
+            timeout = cfg->body_timeout;
+            break;
+
+        case HTTP_PHASE_WRITE:
+            timeout = cfg->write_timeout;
             break;
+    }
+
+    if (timeout)
+        wheel_add(w->wheel, &c->timer, now + timeout * 1000ull);
+    else
+        wheel_remove(w->wheel, &c->timer);
+}
+
+static int process_client(struct worker *const w,
+    struct server_client *const c, const bool io,
+    const unsigned long long now)
+{
+    struct client *const cl = find_or_alloc_client(w, c);
+
+    if (!cl)
+    {
+        fprintf(stderr, "%s: find_or_alloc_client failed\n", __func__);
+        return -1;
+    }
+    else if (io)
+    {
+        bool write, close;
+        const int res = http_update(cl->http, &write, &close);
+
+        if (res || close)
+        {
+            if (res < 0)
+            {
+                fprintf(stderr, "%s: http_update failed\n", __func__);
+                return -1;
+            }
+            else if (remove_client_from_list(w, cl))
+            {
+                fprintf(stderr, "%s: remove_client_from_list failed\n",
+                    __func__);
+                return -1;
+            }
+
+            return 0;
+        }
+
+        server_client_write_pending(cl->c, write);
+    }
+
+    update_timer(w, cl, now);
+    return 0;
+}
+
+static int expire_clients(struct worker *const w,
+    const unsigned long long now)
+{
+    int ret = 0;
+
+    /* Expired clients are closed in bulk, once per wakeup. */
+    for (struct wheel_timer *t = wheel_expire(w->wheel, now); t;)
+    {
+        struct wheel_timer *const next = t->next;
+
+        if (remove_client_from_list(w, t->user))
+        {
+            fprintf(stderr, "%s: remove_client_from_list failed\n",
+                __func__);
+            ret = -1;
         }
-        else if (!c)
+
+        t = next;
+    }
+
+    return ret;
+}
+
+static int worker_loop(struct worker *const w)
+{
+    for (;;)
+    {
+        bool exit;
+        size_t n;
+        unsigned long long now;
+
+        if (get_time(&now))
         {
-            fprintf(stderr, "%s: server_poll failed\n", __func__);
+            fprintf(stderr, "%s: get_time failed\n", __func__);
             return -1;
         }
 
-        struct client *const cl = find_or_alloc_client(h, c);
+        const struct server_ready *const r = server_poll_all(w->server, &n,
+            wheel_timeout(w->wheel, now), &exit);
 
-        if (!cl)
+        if (exit)
+            break;
+        else if (!r)
         {
-            fprintf(stderr, "%s: find_or_alloc_client failed\n", __func__);
+            fprintf(stderr, "%s: server_poll_all failed\n", __func__);
             return -1;
         }
-        else if (io)
+        else if (get_time(&now))
         {
-            bool write, close;
-            const int res = http_update(cl->http, &write, &close);
+            fprintf(stderr, "%s: get_time failed\n", __func__);
+            return -1;
+        }
 
-            if (res || close)
+        for (size_t i = 0; i < n; i++)
+        {
+            const struct server_ready *const rd = &r[i];
+
+            if (rd->c && process_client(w, rd->c, rd->io, now))
             {
-                if (res < 0)
-                {
-                    fprintf(stderr, "%s: http_update failed\n", __func__);
-                    return -1;
-                }
-                else if (remove_client_from_list(h, cl))
-                {
-                    fprintf(stderr, "%s: remove_client_from_list failed\n",
-                        __func__);
-                    return -1;
-                }
+                fprintf(stderr, "%s: process_client failed\n", __func__);
+                return -1;
             }
-            else
-                server_client_write_pending(cl->c, write);
+        }
+
+        if (expire_clients(w, now))
+        {
+            fprintf(stderr, "%s: expire_clients failed\n", __func__);
+            return -1;
         }
     }
 
     return 0;
 }
 
-static void free_clients(struct handler *const h)
+static void *run_worker(void *const arg)
+{
+    struct worker *const w = arg;
+
+    /* Let the first worker, running on the calling thread, know it must
+     * stop all other workers. */
+    if ((w->ret = worker_loop(w)))
+        server_wake(w->h->workers[0].server);
+
+    return NULL;
+}
+
+static int stop_workers(struct handler *const h, const size_t n)
+{
+    int ret = 0;
+
+    for (size_t i = 1; i < n; i++)
+    {
+        struct worker *const w = &h->workers[i];
+        int error;
+
+        if (server_wake(w->server))
+        {
+            fprintf(stderr, "%s: server_wake failed\n", __func__);
+            ret = -1;
+        }
+        else if ((error = pthread_join(w->thread, NULL)))
+        {
+            fprintf(stderr, "%s: pthread_join(3): %s\n",
+                __func__, strerror(error));
+            ret = -1;
+        }
+        else if (w->ret)
+            ret = -1;
+    }
+
+    return ret;
+}
+
+static int start_workers(struct handler *const h, size_t *const n)
+{
+    int ret = -1, error;
+    sigset_t set, oldset;
+
+    /* Only the calling thread shall handle SIGINT and SIGTERM. Other
+     * workers are stopped by the first one via server_wake. */
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    *n = 1;
+
+    if ((error = pthread_sigmask(SIG_BLOCK, &set, &oldset)))
+    {
+        fprintf(stderr, "%s: pthread_sigmask(3): %s\n",
+            __func__, strerror(error));
+        return -1;
+    }
+
+    for (; *n < h->n_workers; (*n)++)
+    {
+        struct worker *const w = &h->workers[*n];
+
+        if ((error = pthread_create(&w->thread, NULL, run_worker, w)))
+        {
+            fprintf(stderr, "%s: pthread_create(3): %s\n",
+                __func__, strerror(error));
+            goto end;
+        }
+    }
+
+    ret = 0;
+
+end:
+    if ((error = pthread_sigmask(SIG_SETMASK, &oldset, NULL)))
+    {
+        fprintf(stderr, "%s: pthread_sigmask(3): %s\n",
+            __func__, strerror(error));
+        ret = -1;
+    }
+
+    return ret;
+}
+
+int handler_loop(struct handler *const h)
 {
-    for (struct client *c = h->clients; c;)
+    int ret = -1;
+    size_t n = 0;
+
+    if (start_workers(h, &n))
+    {
+        fprintf(stderr, "%s: start_workers failed\n", __func__);
+        goto end;
+    }
+    else if (worker_loop(&h->workers[0]))
+    {
+        fprintf(stderr, "%s: worker_loop failed\n", __func__);
+        goto end;
+    }
+
+    printf("Exiting...\n");
+    ret = 0;
+
+end:
+    if (stop_workers(h, n))
+    {
+        fprintf(stderr, "%s: stop_workers failed\n", __func__);
+        ret = -1;
+    }
+
+    return ret;
+}
+
+static void free_clients(struct worker *const w)
+{
+    for (struct client *c = w->clients; c;)
+    {
+        struct client *const next = c->next;
+
+        server_client_close(w->server, c->c);
+        client_free(c);
+        c = next;
+    }
+
+    for (struct client *c = w->spare; c;)
     {
         struct client *const next = c->next;
 
-        server_client_close(h->server, c->c);
         client_free(c);
         c = next;
     }
@@ -259,12 +672,28 @@ void handler_free(struct handler *const h)
 {
     if (h)
     {
-        for (size_t i = 0; i < h->n_cfg; i++)
-            free(h->elem[i].url);
+        for (size_t i = 0; i < h->n_workers; i++)
+        {
+            struct worker *const w = &h->workers[i];
+
+            free_clients(w);
+            server_close(w->server);
+            wheel_free(w->wheel);
+            http_pool_free(w->pool);
+        }
 
-        free(h->elem);
-        free_clients(h);
-        server_close(h->server);
+        for (size_t i = 0; i < sizeof h->routers / sizeof *h->routers; i++)
+            router_free(h->routers[i]);
+
+        for (struct elem *e = h->elem; e;)
+        {
+            struct elem *const next = e->next;
+
+            free(e);
+            e = next;
+        }
+
+        free(h->workers);
     }
 
     free(h);
@@ -282,38 +711,73 @@ struct handler *handler_alloc(const struct handler_cfg *const cfg)
     }
 
     *h = (const struct handler){.cfg = *cfg};
+
+    for (size_t i = 0; i < sizeof h->routers / sizeof *h->routers; i++)
+        if (!(h->routers[i] = router_alloc()))
+        {
+            fprintf(stderr, "%s: router_alloc failed\n", __func__);
+            handler_free(h);
+            return NULL;
+        }
+
     return h;
 }
 
-int handler_add(struct handler *const h, const char *url,
-    const enum http_op op, const handler_fn f, void *const user)
+static int add(struct handler *const h, const char *const url,
+    const enum http_op op, const handler_fn f, void *const user,
+    const bool stream)
 {
-    const size_t n = h->n_cfg + 1;
-    struct elem *const elem = realloc(h->elem, n * sizeof *h->elem);
+    struct elem *const e = malloc(sizeof *e);
 
-    if (!elem)
+    if (!e)
     {
-        fprintf(stderr, "%s: realloc(3): %s\n", __func__, strerror(errno));
+        fprintf(stderr, "%s: malloc(3): %s\n", __func__, strerror(errno));
         return -1;
     }
 
-    struct elem *const e = &elem[h->n_cfg];
-
     *e = (const struct elem)
     {
-        .url = strdup(url),
-        .op = op,
         .f = f,
-        .user = user
+        .user = user,
+        .stream = stream,
+        .next = h->elem
     };
 
-    if (!e->url)
+    /* Routes are kept in registration order, so that router_match
+     * returns the first endpoint added for a given resource. */
+    if (router_add(h->routers[op], url, e))
     {
-        fprintf(stderr, "%s: strdup(3): %s\n", __func__, strerror(errno));
+        fprintf(stderr, "%s: router_add failed\n", __func__);
+        free(e);
         return -1;
     }
 
-    h->elem = elem;
-    h->n_cfg = n;
+    h->elem = e;
     return 0;
 }
+
+int handler_add(struct handler *const h, const char *const url,
+    const enum http_op op, const handler_fn f, void *const user)
+{
+    return add(h, url, op, f, user, false);
+}
+
+int handler_add_stream(struct handler *const h, const char *const url,
+    const enum http_op op, const handler_fn f, void *const user)
+{
+    switch (op)
+    {
+        case HTTP_OP_POST:
+            /* Fall through. */
+        case HTTP_OP_PUT:
+            return add(h, url, op, f, user, true);
+
+        case HTTP_OP_GET:
+            /* Fall through. */
+        case HTTP_OP_HEAD:
+            break;
+    }
+
+    fprintf(stderr, "%s: unexpected op %d\n", __func__, op);
+    return -1;
+}
@@ -1,12 +1,21 @@
 #define _POSIX_C_SOURCE 200809L
 
+/* glibc only exposes O_TMPFILE and fallocate(2) with _GNU_SOURCE. */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include "libweb/http.h"
 #include <dynstr.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdlib.h>
@@ -74,8 +83,9 @@ struct http_ctx
                 } bstate;
 
                 off_t len, written;
-                char *boundary;
-                size_t blen, nforms, nfiles, npairs;
+                unsigned char *skip;
+                char *field;
+                size_t blen, clen, fsize, nforms, nfiles, npairs;
                 int fd;
                 struct http_post_file *files;
                 struct http_post_pair *pairs;
@@ -97,33 +107,341 @@ struct http_ctx
         struct http_arg *args;
         size_t n_args, n_headers;
         struct http_header *headers;
-        bool has_length, expect_continue;
+        struct http_stream stream;
+        bool has_length, expect_continue, chunked, streaming;
+
+        /* Bump allocator for every string and array that lives as long
+         * as the request. Its chunks are kept across requests, so that
+         * parsing a typical request does not call malloc(3) at all. */
+        struct arena
+        {
+            size_t chunk, used, hwm;
+            struct http_pool *pool;
+
+            struct chunk
+            {
+                struct chunk *next;
+                size_t size, used;
+
+                union align
+                {
+                    long double ld;
+                    long long ll;
+                    void *p;
+                    void (*f)(void);
+                } data[];
+            } *head, *cur;
+        } arena;
     } ctx;
 
     struct write_ctx
     {
-        bool pending, close;
+        bool pending, close, sendfile, last_chunk;
         enum state state;
         struct http_response r;
-        off_t n;
+        off_t n, offset;
         struct dynstr d;
         enum http_op op;
     } wctx;
 
-    /* From RFC9112, section 3 (Request line):
-     * It is RECOMMENDED that all HTTP senders and recipients support,
-     * at a minimum, request-line lengths of 8000 octets. */
-    char line[8000];
+    /* Decoder for request bodies sent with Transfer-Encoding: chunked.
+     * It is kept outside struct ctx so that the rest of the body can
+     * still be consumed once the payload has been sent, as it happens
+     * with multipart/form-data. */
+    struct chunked
+    {
+        enum
+        {
+            CHUNK_NONE,
+            CHUNK_SIZE,
+            CHUNK_EXT,
+            CHUNK_SIZE_LF,
+            CHUNK_DATA,
+            CHUNK_DATA_CR,
+            CHUNK_DATA_LF,
+            CHUNK_TRAILER,
+            CHUNK_TRAILER_LF
+        } state;
+
+        unsigned long long left;
+        bool digits, empty;
+    } chunk;
+
+    /* Buffers only needed while a request is in flight. If cfg.pool is
+     * set, they are borrowed from it and given back, along with the
+     * arena chunks, as soon as the connection becomes idle. */
+    struct buffer
+    {
+        struct buffer *next;
+
+        /* Data read from the client but not processed yet. It is filled
+         * with one call to cfg.read and parsed in place, and any leftover
+         * bytes are kept for the next request. data points either to buf
+         * or, while a large body read is being processed, to the read
+         * buffer from the pool. */
+        struct input
+        {
+            char buf[8192];
+            const char *data;
+            size_t off, len;
+        } in;
+
+        /* From RFC9112, section 3 (Request line):
+         * It is RECOMMENDED that all HTTP senders and recipients support,
+         * at a minimum, request-line lengths of 8000 octets. */
+        char line[8000];
+
+        /* Responses to pipelined requests, coalesced so that they can be
+         * sent to the client with a single call to cfg.write. */
+        struct output
+        {
+            char buf[16384];
+            size_t off, len;
+        } out;
+    } *b;
+
     struct http_cfg cfg;
 };
 
-static void arg_free(struct http_arg *const a)
+/* Free buffers and arena chunks, shared by every struct http_ctx using
+ * the same pool, plus a buffer for large body reads. Since the latter
+ * is only used during a call to http_update, it is never owned by any
+ * struct http_ctx. */
+struct http_pool
+{
+    size_t max, n_buffers, n_chunks, read_size;
+    struct buffer *buffers;
+    struct chunk *chunks;
+    char *read_buf;
+};
+
+enum {ARENA_CHUNK = 4096, ARENA_MIN_ELEMS = 4};
+enum {READ_SIZE = 65536, MAX_READS = 16};
+
+static size_t arena_size(const size_t n)
+{
+    const size_t align = sizeof (union align);
+
+    return n + (align - n % align) % align;
+}
+
+static void *arena_alloc(struct arena *const a, const size_t n)
+{
+    const size_t sz = arena_size(n);
+    struct chunk *c = a->cur;
+
+    if (sz < n || sz > SIZE_MAX - sizeof *c)
+    {
+        fprintf(stderr, "%s: size overflow\n", __func__);
+        return NULL;
+    }
+    else if (!c || c->size - c->used < sz)
+    {
+        struct chunk *const next = c ? c->next : NULL;
+
+        if (next && next->size >= sz)
+            next->used = 0;
+        else
+        {
+            const size_t size = sz > a->chunk ? sz : a->chunk;
+            struct http_pool *const p = a->pool;
+            struct chunk *nc;
+
+            if (p && p->chunks && p->chunks->size >= size)
+            {
+                nc = p->chunks;
+                p->chunks = nc->next;
+                p->n_chunks--;
+            }
+            else if (!(nc = malloc(sizeof *nc + size)))
+            {
+                fprintf(stderr, "%s: malloc(3): %s\n",
+                    __func__, strerror(errno));
+                return NULL;
+            }
+            else
+                nc->size = size;
+
+            nc->next = next;
+            nc->used = 0;
+
+            if (c)
+                c->next = nc;
+            else
+                a->head = nc;
+        }
+
+        c = a->cur = c ? c->next : a->head;
+    }
+
+    void *const ret = (char *)c->data + c->used;
+
+    c->used += sz;
+    a->used += sz;
+
+    if (a->used > a->hwm)
+        a->hwm = a->used;
+
+    return ret;
+}
+
+/* Grows ptr in place if it was the last allocation from a. Otherwise, a
+ * new block is allocated and the old one is left unused until the arena
+ * is reset. */
+static void *arena_realloc(struct arena *const a, void *const ptr,
+    const size_t old, const size_t n)
+{
+    const size_t oldsz = arena_size(old), sz = arena_size(n);
+    struct chunk *const c = a->cur;
+
+    if (ptr && (char *)ptr + oldsz == (char *)c->data + c->used
+        && sz >= n && sz >= oldsz && sz - oldsz <= c->size - c->used)
+    {
+        c->used += sz - oldsz;
+        a->used += sz - oldsz;
+
+        if (a->used > a->hwm)
+            a->hwm = a->used;
+
+        return ptr;
+    }
+
+    void *const ret = arena_alloc(a, n);
+
+    if (ret && ptr)
+        memcpy(ret, ptr, old < n ? old : n);
+
+    return ret;
+}
+
+/* Makes room for one more element into array, which already holds n
+ * elements of size sz. Capacity is not stored anywhere: instead, arrays
+ * always hold a power of two elements, starting from ARENA_MIN_ELEMS. */
+static void *arena_append(struct arena *const a, void *const array,
+    const size_t n, const size_t sz)
+{
+    if (n && (n < ARENA_MIN_ELEMS || n & (n - 1)))
+        return array;
+
+    const size_t cap = n ? n * 2 : ARENA_MIN_ELEMS;
+
+    if (cap < n || cap > SIZE_MAX / sz)
+    {
+        fprintf(stderr, "%s: size overflow\n", __func__);
+        return NULL;
+    }
+
+    return arena_realloc(a, array, n * sz, cap * sz);
+}
+
+static char *arena_strndup(struct arena *const a, const char *const s,
+    const size_t n)
+{
+    char *const ret = arena_alloc(a, n + 1);
+
+    if (ret)
+    {
+        memcpy(ret, s, n);
+        ret[n] = '\0';
+    }
+
+    return ret;
+}
+
+/* Makes every chunk available again, in O(1) regardless of how many
+ * chunks were used. Chunks after the first one are emptied by
+ * arena_alloc as they are reused. */
+static void arena_reset(struct arena *const a)
+{
+    if ((a->cur = a->head))
+        a->cur->used = 0;
+
+    a->used = 0;
+}
+
+/* Gives every chunk back to the pool, so that idle connections do not
+ * hold any. Chunks beyond the pool capacity are freed. */
+static void arena_release(struct arena *const a)
+{
+    struct http_pool *const p = a->pool;
+
+    for (struct chunk *c = a->head; c;)
+    {
+        struct chunk *const next = c->next;
+
+        if (p->n_chunks < p->max)
+        {
+            c->next = p->chunks;
+            p->chunks = c;
+            p->n_chunks++;
+        }
+        else
+            free(c);
+
+        c = next;
+    }
+
+    a->head = a->cur = NULL;
+    a->used = 0;
+}
+
+static void arena_free(struct arena *const a)
+{
+    for (struct chunk *c = a->head; c;)
+    {
+        struct chunk *const next = c->next;
+
+        free(c);
+        c = next;
+    }
+
+    a->head = a->cur = NULL;
+}
+
+/* Decodes the first n bytes from url into out, which must be able to
+ * hold at least n + 1 bytes, since decoding never makes a string longer. */
+static int decode_url(const char *const url, const size_t n,
+    const bool spaces, char *const out)
 {
-    if (a)
+    size_t i = 0, j = 0;
+
+    while (i < n)
     {
-        free(a->key);
-        free(a->value);
+        const char c = url[i];
+
+        if (spaces && c == '+')
+        {
+            out[j++] = ' ';
+            i++;
+        }
+        else if (c != '%')
+        {
+            out[j++] = c;
+            i++;
+        }
+        else if (n - i > 2)
+        {
+            const char buf[sizeof "00"] = {url[i + 1], url[i + 2]};
+
+            if (!isxdigit((unsigned char)buf[0])
+                || !isxdigit((unsigned char)buf[1]))
+            {
+                fprintf(stderr, "%s: invalid number %s\n", __func__, buf);
+                return 1;
+            }
+
+            out[j++] = strtoul(buf, NULL, 16);
+            i += 3;
+        }
+        else
+        {
+            fprintf(stderr, "%s: unterminated %%\n", __func__);
+            return 1;
+        }
     }
+
+    out[j] = '\0';
+    return 0;
 }
 
 static size_t chrcnt(const char *s, const int c)
@@ -139,22 +457,17 @@ static size_t chrcnt(const char *s, const int c)
 static int parse_arg(struct ctx *const c, const char *const arg,
     const size_t n)
 {
-    int ret = -1;
-    struct http_arg a = {0}, *args = NULL;
-    const char *sep = memchr(arg, '=', n);
-    char *enckey = NULL, *encvalue = NULL, *deckey = NULL, *decvalue = NULL;
+    const char *const sep = memchr(arg, '=', n);
 
     if (!sep)
     {
         fprintf(stderr, "%s: expected '='\n", __func__);
-        ret = 1;
-        goto end;
+        return 1;
     }
     else if (sep == arg)
     {
         fprintf(stderr, "%s: expected key\n", __func__);
-        ret = 1;
-        goto end;
+        return 1;
     }
 
     const char *const value = sep + 1;
@@ -162,62 +475,33 @@ static int parse_arg(struct ctx *const c, const char *const arg,
     if (!*value)
     {
         fprintf(stderr, "%s: missing value: %.*s\n", __func__, (int)n, arg);
-        ret = 1;
-        goto end;
+        return 1;
     }
 
     const size_t keylen = sep - arg, valuelen = n - keylen - 1;
+    struct http_arg *const a = &c->args[c->n_args];
+    int ret;
 
-    if (!(enckey = strndup(arg, keylen)))
-    {
-        fprintf(stderr, "%s: strndup(3) key: %s\n", __func__, strerror(errno));
-        goto end;
-    }
-    else if (!(encvalue = strndup(value, valuelen)))
+    if (!(a->key = arena_alloc(&c->arena, keylen + 1))
+        || !(a->value = arena_alloc(&c->arena, valuelen + 1)))
     {
-        fprintf(stderr, "%s: strndup(3) value: %s\n",
-            __func__, strerror(errno));
-        goto end;
+        fprintf(stderr, "%s: arena_alloc failed\n", __func__);
+        return -1;
     }
     /* URL parameters use '+' for whitespace, rather than %20. */
-    else if ((ret = http_decode_url(enckey, true, &deckey)))
-    {
-        fprintf(stderr, "%s: http_decode_url enckey failed\n", __func__);
-        goto end;
-    }
-    else if ((ret = http_decode_url(encvalue, true, &decvalue)))
-    {
-        fprintf(stderr, "%s: http_decode_url encvalue failed\n", __func__);
-        goto end;
-    }
-
-    a = (const struct http_arg)
-    {
-        .key = deckey,
-        .value = decvalue
-    };
-
-    if (!(args = realloc(c->args, (c->n_args + 1) * sizeof *args)))
+    else if ((ret = decode_url(arg, keylen, true, a->key)))
     {
-        fprintf(stderr, "%s: realloc(3): %s\n", __func__, strerror(errno));
-        goto end;
+        fprintf(stderr, "%s: decode_url key failed\n", __func__);
+        return ret;
     }
-
-    args[c->n_args++] = a;
-    c->args = args;
-    ret = 0;
-
-end:
-    if (ret)
+    else if ((ret = decode_url(value, valuelen, true, a->value)))
     {
-        arg_free(&a);
-        free(deckey);
-        free(decvalue);
+        fprintf(stderr, "%s: decode_url value failed\n", __func__);
+        return ret;
     }
 
-    free(enckey);
-    free(encvalue);
-    return ret;
+    c->n_args++;
+    return 0;
 }
 
 static int parse_first_arg(struct ctx *const c, const char *const arg,
@@ -269,6 +553,18 @@ static int parse_adargs(struct ctx *const c, const char *const start,
     return 0;
 }
 
+/* Allocates as many arguments as '&' separators follow the argument
+ * indicator, plus one, so that parse_arg never needs to grow c->args. */
+static struct http_arg *alloc_args(struct ctx *const c, const char *arg)
+{
+    size_t n = 1;
+
+    while ((arg = strchr(arg + 1, '&')))
+        n++;
+
+    return arena_alloc(&c->arena, n * sizeof *c->args);
+}
+
 static int parse_args(struct ctx *const c, const char *const res,
     size_t *const reslen)
 {
@@ -302,6 +598,11 @@ static int parse_args(struct ctx *const c, const char *const res,
         fprintf(stderr, "%s: expected '?' before '&': %s\n", __func__, res);
         return 1;
     }
+    else if (!(c->args = alloc_args(c, arg_start)))
+    {
+        fprintf(stderr, "%s: alloc_args failed\n", __func__);
+        return -1;
+    }
     else if ((error = parse_first_arg(c, arg_start, ad_arg, res)))
     {
         fprintf(stderr, "%s: parse_first_arg failed\n", __func__);
@@ -319,33 +620,26 @@ static int parse_args(struct ctx *const c, const char *const res,
 
 static int parse_resource(struct ctx *const c, const char *const enc_res)
 {
-    int ret = -1, error;
+    int error;
     size_t reslen;
-    char *trimmed_encres = NULL, *resource = NULL;
 
     if ((error = parse_args(c, enc_res, &reslen)))
     {
         fprintf(stderr, "%s: parse_args failed\n", __func__);
-        ret = error;
-        goto end;
+        return error;
     }
-    else if (!(trimmed_encres = strndup(enc_res, reslen)))
+    else if (!(c->resource = arena_alloc(&c->arena, reslen + 1)))
     {
-        fprintf(stderr, "%s: strndup(3): %s\n", __func__, strerror(errno));
-        goto end;
+        fprintf(stderr, "%s: arena_alloc failed\n", __func__);
+        return -1;
     }
-    else if ((ret = http_decode_url(trimmed_encres, false, &resource)))
+    else if ((error = decode_url(enc_res, reslen, false, c->resource)))
     {
-        fprintf(stderr, "%s: http_decode_url failed\n", __func__);
-        goto end;
+        fprintf(stderr, "%s: decode_url failed\n", __func__);
+        return error;
     }
 
-    c->resource = resource;
-    ret = 0;
-
-end:
-    free(trimmed_encres);
-    return ret;
+    return 0;
 }
 
 static int get_op(const char *const line, const size_t n,
@@ -371,15 +665,17 @@ static int get_op(const char *const line, const size_t n,
 
 static int start_line(struct http_ctx *const h)
 {
-    const char *const line = h->line;
+    struct ctx *const c = &h->ctx;
+    char *const line = h->b->line;
+    const char *const end = line + c->len;
 
-    if (!*line)
+    if (!c->len)
     {
         fprintf(stderr, "%s: expected non-empty line\n", __func__);
         return 1;
     }
 
-    const char *const op = strchr(line, ' ');
+    const char *const op = memchr(line, ' ', c->len);
 
     if (!op || op == line)
     {
@@ -387,7 +683,6 @@ static int start_line(struct http_ctx *const h)
         return 1;
     }
 
-    struct ctx *const c = &h->ctx;
     const size_t n = op - line;
 
     if (get_op(line, n, &c->op))
@@ -398,7 +693,7 @@ static int start_line(struct http_ctx *const h)
     }
 
     const char *const resource = op + 1,
-        *const res_end = strchr(resource, ' ');
+        *const res_end = memchr(resource, ' ', end - resource);
 
     if (!res_end)
     {
@@ -422,41 +717,34 @@ static int start_line(struct http_ctx *const h)
         fprintf(stderr, "%s: expected protocol version\n", __func__);
         return 1;
     }
-    else if (strchr(protocol, ' '))
+    else if (memchr(protocol, ' ', end - protocol))
     {
         fprintf(stderr, "%s: unexpected field after protocol version\n",
             __func__);
         return 1;
     }
 
-    int ret = 1, error;
-    char *enc_res = NULL;
+    int error;
 
     if (strcmp(protocol, HTTP_VERSION))
     {
         fprintf(stderr, "%s: unsupported protocol %s\n", __func__, protocol);
-        goto end;
-    }
-    else if (!(enc_res = strndup(resource, res_n)))
-    {
-        fprintf(stderr, "%s: strndup(3): %s\n", __func__, strerror(errno));
-        ret = -1;
-        goto end;
+        return 1;
     }
-    else if ((error = parse_resource(c, enc_res)))
+
+    /* Terminate the resource in place, so that it can be parsed without
+     * being copied first. */
+    line[res_end - line] = '\0';
+
+    if ((error = parse_resource(c, resource)))
     {
         fprintf(stderr, "%s: parse_resource failed\n", __func__);
-        ret = error;
-        goto end;
+        return error;
     }
 
     printf("%.*s %s %s\n", (int)n, line, c->resource, protocol);
-    ret = 0;
     c->state = HEADER_CR_LINE;
-
-end:
-    free(enc_res);
-    return ret;
+    return 0;
 }
 
 static void ctx_free(struct ctx *const c)
@@ -465,30 +753,29 @@ static void ctx_free(struct ctx *const c)
     {
         struct multiform *const m = &c->u.mf;
 
-        free(m->files);
-        free(m->pairs);
-        free(m->boundary);
-
         if (m->fd >= 0 && close(m->fd))
             fprintf(stderr, "%s: close(2) m->fd: %s\n",
                 __func__, strerror(errno));
 
+        free(m->field);
+
         for (size_t i = 0; i < m->nforms; i++)
         {
-            struct form *const f = &m->forms[i];
-
-            free(f->name);
-            free(f->filename);
-            free(f->value);
+            const struct form *const f = &m->forms[i];
 
             if (f->tmpname && remove(f->tmpname) && errno != ENOENT)
                 fprintf(stderr, "%s: remove(3) %s: %s\n",
                     __func__, f->tmpname, strerror(errno));
-
-            free(f->tmpname);
         }
 
-        free(m->forms);
+        for (size_t i = 0; i < m->nfiles; i++)
+        {
+            const struct http_post_file *const pf = &m->files[i];
+
+            if (pf->fd >= 0 && close(pf->fd))
+                fprintf(stderr, "%s: close(2) pf->fd: %s\n",
+                    __func__, strerror(errno));
+        }
     }
     else if (c->op == HTTP_OP_PUT)
     {
@@ -497,29 +784,14 @@ static void ctx_free(struct ctx *const c)
         if (p->fd >= 0 && close(p->fd))
             fprintf(stderr, "%s: close(2) p->fd: %s\n",
                 __func__, strerror(errno));
-
-        free(c->u.put.tmpname);
     }
 
-    free(c->field);
-    free(c->value);
-    free(c->resource);
-    free(c->boundary);
-
-    for (size_t i = 0; i < c->n_args; i++)
-        arg_free(&c->args[i]);
-
-    for (size_t i = 0; i < c->n_headers; i++)
-    {
-        const struct http_header *const hdr = &c->headers[i];
-
-        free(hdr->header);
-        free(hdr->value);
-    }
+    /* Every other resource was allocated from the arena, whose chunks
+     * are kept for the next request. */
+    struct arena a = c->arena;
 
-    free(c->headers);
-    free(c->args);
-    *c = (const struct ctx){0};
+    arena_reset(&a);
+    *c = (const struct ctx){.arena = a};
 }
 
 static void free_response_headers(struct http_response *const r)
@@ -544,8 +816,6 @@ static int prepare_headers(struct http_ctx *const h)
     struct dynstr *const d = &w->d;
     struct http_response *const r = &w->r;
 
-    dynstr_init(d);
-
     for (size_t i = 0; i < w->r.n_headers; i++)
     {
         const struct http_header *const hdr = &r->headers[i];
@@ -601,45 +871,6 @@ static int rw_error(const int r, bool *const close)
     return -1;
 }
 
-static int write_start_line(struct http_ctx *const h, bool *const close)
-{
-    struct write_ctx *const w = &h->wctx;
-    struct dynstr *const d = &w->d;
-    const size_t rem = d->len - w->n;
-    const int res = h->cfg.write(d->str + w->n, rem, h->cfg.user);
-
-    if (res <= 0)
-        return rw_error(res, close);
-    else if ((w->n += res) >= d->len)
-    {
-        char len[sizeof "18446744073709551615"];
-        const int res = snprintf(len, sizeof len, "%llu", w->r.n);
-
-        dynstr_free(d);
-
-        if (res < 0 || res >= sizeof len)
-        {
-            fprintf(stderr, "%s: snprintf(3) failed\n", __func__);
-            return -1;
-        }
-        else if (http_response_add_header(&w->r, "Content-Length", len))
-        {
-            fprintf(stderr, "%s: http_response_add_header failed\n", __func__);
-            return -1;
-        }
-        else if (prepare_headers(h))
-        {
-            fprintf(stderr, "%s: prepare_headers failed\n", __func__);
-            return -1;
-        }
-
-        w->state = HEADER_CR_LINE;
-        w->n = 0;
-    }
-
-    return 0;
-}
-
 static int write_ctx_free(struct write_ctx *const w)
 {
     int ret = 0;
@@ -662,36 +893,125 @@ static bool must_write_body(const struct write_ctx *const w)
     return w->op != HTTP_OP_HEAD;
 }
 
-static int write_header_cr_line(struct http_ctx *const h, bool *const close)
+static int end_response(struct http_ctx *const h, bool *const close)
 {
     struct write_ctx *const w = &h->wctx;
-    struct dynstr *const d = &w->d;
-    const size_t rem = d->len - w->n;
-    const int res = h->cfg.write(d->str + w->n, rem, h->cfg.user);
+    const bool close_pending = w->close;
 
-    if (res <= 0)
-        return rw_error(res, close);
-    else if ((w->n += res) >= d->len)
+    if (write_ctx_free(w))
     {
-        const bool close_pending = w->close;
+        fprintf(stderr, "%s: write_ctx_free failed\n", __func__);
+        return -1;
+    }
+    else if (close_pending)
+        *close = true;
 
-        dynstr_free(d);
+    return 0;
+}
 
-        if (w->r.n && must_write_body(w))
-        {
-            w->state = BODY_LINE;
-            w->n = 0;
-        }
-        else if (write_ctx_free(w))
-        {
-            fprintf(stderr, "%s: write_ctx_free failed\n", __func__);
+static int prepare_file_body(struct http_ctx *const h)
+{
+    struct write_ctx *const w = &h->wctx;
+    FILE *const f = w->r.f;
+    const int fd = fileno(f);
+    struct stat sb;
+
+    /* File bodies start from the current position of r->f. */
+    if ((w->offset = ftello(f)) < 0)
+    {
+        fprintf(stderr, "%s: ftello(3): %s\n", __func__, strerror(errno));
+        return -1;
+    }
+
+    /* sendfile(2) might only support regular files as input. */
+    w->sendfile = h->cfg.sendfile && fd >= 0 && !fstat(fd, &sb)
+        && S_ISREG(sb.st_mode);
+    return 0;
+}
+
+static size_t output_left(const struct http_ctx *const h)
+{
+    const struct buffer *const b = h->b;
+
+    return b ? b->out.len - b->out.off : 0;
+}
+
+static bool write_pending(const struct http_ctx *const h)
+{
+    return h->wctx.pending || output_left(h);
+}
+
+static int write_output(struct http_ctx *const h, bool *const close)
+{
+    struct output *const o = &h->b->out;
+    const int res = h->cfg.write(o->buf + o->off, o->len - o->off,
+        h->cfg.user);
+
+    if (res <= 0)
+        return rw_error(res, close);
+    else if ((o->off += res) >= o->len)
+        o->off = o->len = 0;
+
+    return 0;
+}
+
+static int write_head(struct http_ctx *const h, bool *const close)
+{
+    struct write_ctx *const w = &h->wctx;
+    const struct http_response *const r = &w->r;
+    struct dynstr *const d = &w->d;
+    const size_t rem = d->len - w->n;
+    const bool body = (r->n || r->chunk) && must_write_body(w);
+    int res;
+
+    /* In-memory bodies are sent along with the status line and headers,
+     * so that small responses only require one system call. */
+    if (h->cfg.writev && body && !r->chunk && r->buf.ro && rem < INT_MAX)
+    {
+        const size_t max = INT_MAX - rem;
+        const struct iovec iov[] =
+        {
+            {
+                .iov_base = d->str + w->n,
+                .iov_len = rem
+            },
+
+            {
+                .iov_base = r->buf.rw,
+                .iov_len = r->n > max ? max : r->n
+            }
+        };
+
+        res = h->cfg.writev(iov, sizeof iov / sizeof *iov, h->cfg.user);
+    }
+    else
+        res = h->cfg.write(d->str + w->n, rem, h->cfg.user);
+
+    if (res <= 0)
+        return rw_error(res, close);
+    else if ((w->n += res) < d->len)
+        return 0;
+
+    const off_t written = w->n - d->len;
+
+    dynstr_free(d);
+
+    if (body)
+    {
+        w->state = BODY_LINE;
+
+        if (r->chunk)
+            return 0;
+        else if (r->f && prepare_file_body(h))
+        {
+            fprintf(stderr, "%s: prepare_file_body failed\n", __func__);
             return -1;
         }
-        else if (close_pending)
-            *close = true;
+        else if ((w->n = written) < r->n)
+            return 0;
     }
 
-    return 0;
+    return end_response(h, close);
 }
 
 static int write_body_mem(struct http_ctx *const h, bool *const close)
@@ -705,19 +1025,27 @@ static int write_body_mem(struct http_ctx *const h, bool *const close)
     if (res <= 0)
         return rw_error(res, close);
     else if ((w->n += res) >= r->n)
-    {
-        const bool close_pending = w->close;
+        return end_response(h, close);
 
-        if (write_ctx_free(w))
-        {
-            fprintf(stderr, "%s: write_ctx_free failed\n", __func__);
-            return -1;
-        }
-        else if (close_pending)
-            *close = true;
+    return 0;
+}
 
-        return res;
-    }
+/* Sends the body directly from the file descriptor behind r->f, so
+ * that it is not copied through user space. Since the offset is given
+ * explicitly, the file position is never modified. */
+static int write_body_fd(struct http_ctx *const h, bool *const close)
+{
+    struct write_ctx *const w = &h->wctx;
+    const struct http_response *const r = &w->r;
+    const unsigned long long left = r->n - w->n;
+    const size_t rem = left > INT_MAX ? INT_MAX : left;
+    const int res = h->cfg.sendfile(fileno(r->f), w->offset + w->n, rem,
+        h->cfg.user);
+
+    if (res <= 0)
+        return rw_error(res, close);
+    else if ((w->n += res) >= r->n)
+        return end_response(h, close);
 
     return 0;
 }
@@ -726,34 +1054,114 @@ static int write_body_file(struct http_ctx *const h, bool *const close)
 {
     struct write_ctx *const w = &h->wctx;
     const struct http_response *const r = &w->r;
+
+    if (w->sendfile)
+        return write_body_fd(h, close);
+
     const unsigned long long left = r->n - w->n;
     char buf[BUFSIZ];
-    const size_t rem = left > sizeof buf ? sizeof buf : left;
+    const size_t rem = left > sizeof buf ? sizeof buf : left,
+        n = fread(buf, 1, rem, r->f);
 
-    if (!fread(buf, 1, rem, r->f))
+    if (!n)
     {
         fprintf(stderr, "%s: fread(3) failed, ferror=%d, feof=%d\n",
             __func__, ferror(r->f), feof(r->f));
         return -1;
     }
 
-    const int res = h->cfg.write(buf, rem, h->cfg.user);
+    const int res = h->cfg.write(buf, n, h->cfg.user);
+    const size_t written = res > 0 ? res : 0;
 
-    if (res <= 0)
+    /* Rewind any bytes that could not be sent, so that they are read
+     * again on the next call. */
+    if (written < n && fseeko(r->f, -(off_t)(n - written), SEEK_CUR))
+    {
+        fprintf(stderr, "%s: fseeko(3): %s\n", __func__, strerror(errno));
+        return -1;
+    }
+    else if (res <= 0)
         return rw_error(res, close);
     else if ((w->n += res) >= r->n)
+        return end_response(h, close);
+
+    return 0;
+}
+
+/* Each chunk is produced right after its header, leaving enough room
+ * for the trailing CRLF and the last chunk, and the header is then
+ * copied just before it, so that no data has to be moved around.
+ * Errors reported by r->chunk only close the connection, since the
+ * status line has already been sent to the client. */
+static int fill_chunk(struct http_ctx *const h)
+{
+    enum {HDR = sizeof "ffffffff\r\n" - 1};
+    static const char crlf[] = "\r\n", last[] = "0\r\n\r\n";
+    struct write_ctx *const w = &h->wctx;
+    const struct http_response *const r = &w->r;
+    struct output *const o = &h->b->out;
+    char *const data = o->buf + HDR;
+    const size_t max = sizeof o->buf - HDR - strlen(crlf) - strlen(last);
+    const int n = r->chunk(data, max, r->buf.rw);
+
+    if (n < 0)
+    {
+        fprintf(stderr, "%s: chunk callback failed\n", __func__);
+        return 1;
+    }
+    else if ((size_t)n > max)
+    {
+        fprintf(stderr, "%s: unexpected length %d\n", __func__, n);
+        return -1;
+    }
+    else if (!n)
+    {
+        memcpy(o->buf, last, strlen(last));
+        o->off = 0;
+        o->len = strlen(last);
+        w->last_chunk = true;
+        return 0;
+    }
+
+    char hdr[HDR + 1];
+    const int len = snprintf(hdr, sizeof hdr, "%x\r\n", (unsigned)n);
+
+    if (len < 0 || len > HDR)
     {
-        const bool close_pending = w->close;
+        fprintf(stderr, "%s: snprintf(3) failed with %d\n", __func__, len);
+        return -1;
+    }
 
-        if (write_ctx_free(w))
-        {
-            fprintf(stderr, "%s: write_ctx_free failed\n", __func__);
-            return -1;
-        }
-        else if (close_pending)
-            *close = true;
+    memcpy(data - len, hdr, len);
+    memcpy(data + n, crlf, strlen(crlf));
+    o->off = HDR - len;
+    o->len = HDR + n + strlen(crlf);
+    return 0;
+}
+
+/* Chunks are pulled from r->chunk only once the previous one has been
+ * fully sent, so that memory usage is bounded by the output buffer. */
+static int write_body_chunk(struct http_ctx *const h, bool *const close)
+{
+    struct write_ctx *const w = &h->wctx;
+
+    if (!output_left(h))
+    {
+        int ret;
+
+        if (w->last_chunk)
+            return end_response(h, close);
+        else if ((ret = fill_chunk(h)))
+            return ret;
     }
 
+    const int ret = write_output(h, close);
+
+    if (ret || *close)
+        return ret;
+    else if (!output_left(h) && w->last_chunk)
+        return end_response(h, close);
+
     return 0;
 }
 
@@ -761,7 +1169,9 @@ static int write_body_line(struct http_ctx *const h, bool *const close)
 {
     const struct http_response *const r = &h->wctx.r;
 
-    if (r->buf.ro)
+    if (r->chunk)
+        return write_body_chunk(h, close);
+    else if (r->buf.ro)
         return write_body_mem(h, close);
     else if (r->f)
         return write_body_file(h, close);
@@ -774,19 +1184,38 @@ static int http_write(struct http_ctx *const h, bool *const close)
 {
     static int (*const fn[])(struct http_ctx *, bool *) =
     {
-        [START_LINE] = write_start_line,
-        [HEADER_CR_LINE] = write_header_cr_line,
+        [START_LINE] = write_head,
         [BODY_LINE] = write_body_line,
     };
 
     struct write_ctx *const w = &h->wctx;
+    enum state state;
 
-    const int ret = fn[w->state](h, close);
+    if (output_left(h))
+    {
+        const int ret = write_output(h, close);
 
-    if (ret)
-        write_ctx_free(w);
+        if (ret || *close || output_left(h))
+            return ret;
+    }
 
-    return ret;
+    if (!w->pending)
+        return 0;
+
+    /* Move on to the next stage as soon as the previous one has been
+     * completed, instead of waiting for another call to http_update. */
+    do
+    {
+        const int ret = fn[state = w->state](h, close);
+
+        if (ret)
+        {
+            write_ctx_free(w);
+            return ret;
+        }
+    } while (w->pending && w->state != state);
+
+    return 0;
 }
 
 int http_response_add_header(struct http_response *const r,
@@ -842,11 +1271,32 @@ static int start_response(struct http_ctx *const h)
     w->pending = true;
     dynstr_init(&w->d);
 
+    /* The status line and headers are serialized at once, so that they
+     * can be sent with as few system calls as possible. */
     if (dynstr_append(&w->d, HTTP_VERSION " %d %s\r\n", c->code, c->descr))
     {
         fprintf(stderr, "%s: dynstr_append failed\n", __func__);
         return -1;
     }
+    else if (w->r.chunk)
+    {
+        if (dynstr_append(&w->d, "Transfer-Encoding: chunked\r\n"))
+        {
+            fprintf(stderr, "%s: dynstr_append chunked failed\n", __func__);
+            return -1;
+        }
+    }
+    else if (dynstr_append(&w->d, "Content-Length: %llu\r\n", w->r.n))
+    {
+        fprintf(stderr, "%s: dynstr_append length failed\n", __func__);
+        return -1;
+    }
+
+    if (prepare_headers(h))
+    {
+        fprintf(stderr, "%s: prepare_headers failed\n", __func__);
+        return -1;
+    }
 
     return 0;
 }
@@ -860,31 +1310,27 @@ static int set_cookie(struct http_ctx *const h, const char *const cookie)
     {
         fprintf(stderr, "%s: expected field=value for cookie %s\n",
             __func__, cookie);
-        goto failure;
+        return -1;
     }
     else if (!*(value + 1))
     {
         fprintf(stderr, "%s: expected non-empty value for cookie %s\n",
             __func__, cookie);
-        goto failure;
+        return -1;
     }
-    else if (!(c->field = strndup(cookie, value - cookie)))
+    else if (!(c->field = arena_strndup(&c->arena, cookie, value - cookie)))
     {
-        fprintf(stderr, "%s: malloc(3) field: %s\n", __func__, strerror(errno));
-        goto failure;
+        fprintf(stderr, "%s: arena_strndup field failed\n", __func__);
+        return -1;
     }
-    else if (!(c->value = strdup(value + 1)))
+    else if (!(c->value = arena_strndup(&c->arena, value + 1,
+        strlen(value + 1))))
     {
-        fprintf(stderr, "%s: malloc(3) value: %s\n", __func__, strerror(errno));
-        goto failure;
+        fprintf(stderr, "%s: arena_strndup value failed\n", __func__);
+        return -1;
     }
 
     return 0;
-
-failure:
-    free(c->field);
-    free(c->value);
-    return -1;
 }
 
 static int set_length(struct http_ctx *const h, const char *const len)
@@ -924,6 +1370,38 @@ static int set_length(struct http_ctx *const h, const char *const len)
     return 0;
 }
 
+static int set_transfer_encoding(struct http_ctx *const h,
+    const char *const encoding)
+{
+    struct ctx *const c = &h->ctx;
+
+    if (strcasecmp(encoding, "chunked"))
+    {
+        fprintf(stderr, "%s: unsupported Transfer-Encoding %s\n",
+            __func__, encoding);
+        return 1;
+    }
+
+    switch (c->op)
+    {
+        case HTTP_OP_PUT:
+            c->u.put = (const struct put){.fd = -1};
+            /* Fall through. */
+        case HTTP_OP_POST:
+            break;
+
+        case HTTP_OP_GET:
+            /* Fall through. */
+        case HTTP_OP_HEAD:
+            fprintf(stderr, "%s: unexpected header for HTTP op %d\n",
+                __func__, c->op);
+            return 1;
+    }
+
+    c->chunked = true;
+    return 0;
+}
+
 static int set_content_type(struct http_ctx *const h, const char *const type)
 {
     const char *const sep = strchr(type, ';');
@@ -987,17 +1465,16 @@ static int set_content_type(struct http_ctx *const h, const char *const type)
     }
 
     struct ctx *const c = &h->ctx;
-    struct dynstr b;
+    char *const b = arena_alloc(&c->arena, strlen("\r\n--") + strlen(val) + 1);
 
-    dynstr_init(&b);
-
-    if (dynstr_append(&b, "\r\n--%s", val))
+    if (!b)
     {
-        fprintf(stderr, "%s: dynstr_append failed\n", __func__);
+        fprintf(stderr, "%s: arena_alloc failed\n", __func__);
         return -1;
     }
 
-    c->boundary = b.str;
+    sprintf(b, "\r\n--%s", val);
+    c->boundary = b;
     c->u.mf = (const struct multiform){.fd = -1};
     return 0;
 }
@@ -1021,9 +1498,63 @@ static struct http_payload ctx_to_payload(const struct ctx *const c)
     };
 }
 
+static int send_payload(struct http_ctx *const h,
+    const struct http_payload *const p)
+{
+    struct ctx *const c = &h->ctx;
+    const int ret = h->cfg.payload(p, &h->wctx.r, h->cfg.user);
+
+    ctx_free(c);
+
+    if (ret)
+        return ret;
+
+    return start_response(h);
+}
+
+static int end_stream(struct http_ctx *const h)
+{
+    struct ctx *const c = &h->ctx;
+    struct http_stream *const s = &c->stream;
+    struct http_payload p = ctx_to_payload(c);
+
+    s->buf = NULL;
+    s->n = 0;
+    s->last = true;
+    c->streaming = false;
+    p.stream = s;
+    return send_payload(h, &p);
+}
+
+/* Gives streaming handlers a chance to release any resources bound to
+ * the request, in case the connection is closed before the body has
+ * been completely received. Any response is ignored. */
+static void abort_stream(struct http_ctx *const h)
+{
+    struct ctx *const c = &h->ctx;
+    struct http_stream *const s = &c->stream;
+
+    if (c->streaming)
+    {
+        struct http_payload p = ctx_to_payload(c);
+        struct http_response r = {0};
+
+        s->buf = NULL;
+        s->n = 0;
+        s->aborted = true;
+        c->streaming = false;
+        p.stream = s;
+        h->cfg.payload(&p, &r, h->cfg.user);
+    }
+}
+
 static int process_payload(struct http_ctx *const h)
 {
     struct ctx *const c = &h->ctx;
+
+    if (c->streaming)
+        return end_stream(h);
+
     const struct http_payload p = ctx_to_payload(c);
     const int ret = h->cfg.payload(&p, &h->wctx.r, h->cfg.user);
 
@@ -1036,10 +1567,10 @@ static int process_payload(struct http_ctx *const h)
     return start_response(h);
 }
 
-static int get_field_value(const char *const line, size_t *const n,
-    const char **const value)
+static int get_field_value(const char *const line, const size_t len,
+    size_t *const n, const char **const value)
 {
-    const char *const field = strchr(line, ':');
+    const char *const field = memchr(line, ':', len);
 
     if (!field || line == field)
     {
@@ -1068,7 +1599,7 @@ static int expect(struct http_ctx *const h, const char *const value)
     {
         struct ctx *const c = &h->ctx;
 
-        if (!c->has_length)
+        if (!c->has_length && !c->chunked)
         {
             fprintf(stderr, "%s: 100-continue without expected content\n",
                 __func__);
@@ -1101,47 +1632,28 @@ static int append_header(struct http_ctx *const h, const char *const line,
 
     if (c->n_headers >= h->cfg.max_headers)
         return 0;
-
-    struct http_header *const headers = realloc(c->headers,
-        (c->n_headers + 1) * sizeof *headers);
-    char *headerdup = NULL, *valuedup = NULL;
-    int ret = -1;
-
-    if (!headers)
+    else if (!(c->headers = arena_append(&c->arena, c->headers,
+        c->n_headers, sizeof *c->headers)))
     {
-        fprintf(stderr, "%s: realloc(3): %s\n", __func__, strerror(errno));
+        fprintf(stderr, "%s: arena_append failed\n", __func__);
         return -1;
     }
 
-    c->headers = headers;
+    struct http_header *const hdr = &c->headers[c->n_headers];
 
-    if (!(headerdup = strndup(line, n)))
-    {
-        fprintf(stderr, "%s: strndup(3): %s\n", __func__, strerror(errno));
-        goto end;
-    }
-    else if (!(valuedup = strdup(value)))
+    if (!(hdr->header = arena_strndup(&c->arena, line, n)))
     {
-        fprintf(stderr, "%s: strdup(3): %s\n", __func__, strerror(errno));
-        goto end;
+        fprintf(stderr, "%s: arena_strndup header failed\n", __func__);
+        return -1;
     }
-
-    c->headers[c->n_headers++] = (const struct http_header)
-    {
-        .header = headerdup,
-        .value = valuedup
-    };
-
-    ret = 0;
-
-end:
-    if (ret)
+    else if (!(hdr->value = arena_strndup(&c->arena, value, strlen(value))))
     {
-        free(headerdup);
-        free(valuedup);
+        fprintf(stderr, "%s: arena_strndup value failed\n", __func__);
+        return -1;
     }
 
-    return ret;
+    c->n_headers++;
+    return 0;
 }
 
 static int process_header(struct http_ctx *const h, const char *const line,
@@ -1171,6 +1683,11 @@ static int process_header(struct http_ctx *const h, const char *const line,
         {
             .header = "Content-Type",
             .f = set_content_type
+        },
+
+        {
+            .header = "Transfer-Encoding",
+            .f = set_transfer_encoding
         }
     };
 
@@ -1179,7 +1696,12 @@ static int process_header(struct http_ctx *const h, const char *const line,
         const struct header *const hdr = &headers[i];
         int ret;
 
-        if (!strncasecmp(line, hdr->header, n) && (ret = hdr->f(h, value)))
+        /* Compare lengths first, so that most headers are rejected
+         * without a case-insensitive comparison, and so that prefixes
+         * such as "Content" are not mistaken for known headers. */
+        if (n == strlen(hdr->header)
+            && !strncasecmp(line, hdr->header, n)
+            && (ret = hdr->f(h, value)))
             return ret;
     }
 
@@ -1230,28 +1752,81 @@ static int process_expect(struct http_ctx *const h)
     return start_response(h);
 }
 
-static int header_cr_line(struct http_ctx *const h)
+static int start_chunked(struct http_ctx *const h)
 {
-    const char *const line = (const char *)h->line;
     struct ctx *const c = &h->ctx;
 
-    if (!*line)
+    /* From RFC9112, section 6.1 (Transfer-Encoding):
+     * A sender MUST NOT send a Content-Length header field in any
+     * message that contains a Transfer-Encoding header field. */
+    if (c->has_length)
     {
-        switch (c->op)
-        {
-            case HTTP_OP_GET:
-                /* Fall through. */
-            case HTTP_OP_HEAD:
-                return process_payload(h);
+        fprintf(stderr, "%s: unexpected Content-Length\n", __func__);
+        return 1;
+    }
 
-            case HTTP_OP_POST:
-            {
-                if (!c->payload.len)
-                    return process_payload(h);
-                else if (c->expect_continue)
-                    return process_expect(h);
-                else if (c->boundary)
-                {
+    h->chunk = (const struct chunked){.state = CHUNK_SIZE};
+
+    if (c->expect_continue)
+        return process_expect(h);
+
+    c->state = BODY_LINE;
+    return 0;
+}
+
+/* Request bodies are handed to handlers as they arrive, instead of being
+ * stored, if requested so by cfg.stream. */
+static void set_stream(struct http_ctx *const h)
+{
+    struct ctx *const c = &h->ctx;
+
+    switch (c->op)
+    {
+        case HTTP_OP_POST:
+            /* Fall through. */
+        case HTTP_OP_PUT:
+            if (h->cfg.stream)
+            {
+                const struct http_payload p = ctx_to_payload(c);
+
+                c->streaming = h->cfg.stream(&p, h->cfg.user);
+            }
+
+            break;
+
+        case HTTP_OP_GET:
+            /* Fall through. */
+        case HTTP_OP_HEAD:
+            break;
+    }
+}
+
+static int header_cr_line(struct http_ctx *const h)
+{
+    const char *const line = (const char *)h->b->line;
+    struct ctx *const c = &h->ctx;
+
+    if (!*line)
+    {
+        set_stream(h);
+
+        switch (c->op)
+        {
+            case HTTP_OP_GET:
+                /* Fall through. */
+            case HTTP_OP_HEAD:
+                return process_payload(h);
+
+            case HTTP_OP_POST:
+            {
+                if (c->chunked)
+                    return start_chunked(h);
+                else if (!c->payload.len)
+                    return process_payload(h);
+                else if (c->expect_continue)
+                    return process_expect(h);
+                else if (c->boundary)
+                {
                     const int res = check_length(h);
 
                     if (res)
@@ -1273,7 +1848,9 @@ static int header_cr_line(struct http_ctx *const h)
             }
 
             case HTTP_OP_PUT:
-                if (!c->has_length)
+                if (c->chunked)
+                    return start_chunked(h);
+                else if (!c->has_length)
                 {
                     fprintf(stderr, "%s: expected Content-Length header\n",
                         __func__);
@@ -1291,7 +1868,7 @@ static int header_cr_line(struct http_ctx *const h)
 
     const char *value;
     size_t n;
-    const int ret = get_field_value(line, &n, &value);
+    const int ret = get_field_value(line, c->len, &n, &value);
 
     if (ret)
         return ret;
@@ -1299,22 +1876,9 @@ static int header_cr_line(struct http_ctx *const h)
     return process_header(h, line, n, value);
 }
 
-static int send_payload(struct http_ctx *const h,
-    const struct http_payload *const p)
-{
-    struct ctx *const c = &h->ctx;
-    const int ret = h->cfg.payload(p, &h->wctx.r, h->cfg.user);
-
-    ctx_free(c);
-
-    if (ret)
-        return ret;
-
-    return start_response(h);
-}
-
 static int update_lstate(struct http_ctx *const h, bool *const close,
-    int (*const f)(struct http_ctx *), const char b)
+    int (*const f)(struct http_ctx *), const char **const buf,
+    size_t *const n)
 {
     int ret = 1;
     struct ctx *const c = &h->ctx;
@@ -1322,32 +1886,54 @@ static int update_lstate(struct http_ctx *const h, bool *const close,
     switch (c->lstate)
     {
         case LINE_CR:
-            if (b == '\r')
-                c->lstate = LINE_LF;
-            else if (c->len < sizeof h->line - 2)
-                h->line[c->len++] = b;
-            else
+        {
+            /* Copy every byte up to CR, if any, at once. */
+            const char *const cr = memchr(*buf, '\r', *n);
+            const size_t len = cr ? cr - *buf : *n;
+
+            if (len > sizeof h->b->line - 2 - c->len)
             {
                 fprintf(stderr, "%s: line too long\n", __func__);
                 goto failure;
             }
 
+            memcpy(&h->b->line[c->len], *buf, len);
+            c->len += len;
+
+            if (cr)
+            {
+                c->lstate = LINE_LF;
+                *buf += len + 1;
+                *n -= len + 1;
+            }
+            else
+            {
+                *buf += len;
+                *n -= len;
+            }
+        }
             break;
 
         case LINE_LF:
+        {
+            const char b = **buf;
+
+            (*buf)++;
+            (*n)--;
+
             if (b == '\n')
             {
-                h->line[c->len] = '\0';
+                h->b->line[c->len] = '\0';
 
                 if ((ret = f(h)))
                     goto failure;
 
                 c->len = 0;
             }
-            else if (c->len < sizeof h->line - 3)
+            else if (c->len < sizeof h->b->line - 3)
             {
-                h->line[c->len++] = '\r';
-                h->line[c->len++] = b;
+                h->b->line[c->len++] = '\r';
+                h->b->line[c->len++] = b;
             }
             else
             {
@@ -1356,6 +1942,7 @@ static int update_lstate(struct http_ctx *const h, bool *const close,
             }
 
             c->lstate = LINE_CR;
+        }
             break;
     }
 
@@ -1370,7 +1957,7 @@ static int start_boundary_line(struct http_ctx *const h)
 {
     struct ctx *const c = &h->ctx;
     struct multiform *const m = &c->u.mf;
-    const char *const line = h->line;
+    const char *const line = h->b->line;
 
     if (strcmp(line, c->boundary + strlen("\r\n")))
     {
@@ -1387,6 +1974,8 @@ static int start_boundary_line(struct http_ctx *const h)
 static int cd_fields(struct http_ctx *const h, struct form *const f,
     const char *sep)
 {
+    struct arena *const a = &h->ctx.arena;
+
     do
     {
         while (*++sep == ' ')
@@ -1423,10 +2012,9 @@ static int cd_fields(struct http_ctx *const h, struct form *const f,
                 fprintf(stderr, "%s: expected non-empty name\n", __func__);
                 return 1;
             }
-            else if (!(f->name = strndup(evalue, evlen)))
+            else if (!(f->name = arena_strndup(a, evalue, evlen)))
             {
-                fprintf(stderr, "%s: strndup(3): %s\n",
-                    __func__, strerror(errno));
+                fprintf(stderr, "%s: arena_strndup failed\n", __func__);
                 return -1;
             }
         }
@@ -1437,9 +2025,9 @@ static int cd_fields(struct http_ctx *const h, struct form *const f,
                 fprintf(stderr, "%s: expected non-empty filename\n", __func__);
                 return 1;
             }
-            else if (!(f->filename = strndup(evalue, evlen)))
+            else if (!(f->filename = arena_strndup(a, evalue, evlen)))
             {
-                fprintf(stderr, "%s: strndup(3): %s\n", __func__, strerror(errno));
+                fprintf(stderr, "%s: arena_strndup failed\n", __func__);
                 return -1;
             }
             else if (!strcmp(f->filename, ".")
@@ -1466,7 +2054,8 @@ static int set_content_disposition(struct http_ctx *const h,
     const char *const c)
 {
     const char *const sep = strchr(c, ';');
-    struct multiform *const m = &h->ctx.u.mf;
+    struct ctx *const ctx = &h->ctx;
+    struct multiform *const m = &ctx->u.mf;
 
     if (!sep)
     {
@@ -1480,38 +2069,64 @@ static int set_content_disposition(struct http_ctx *const h,
         return 1;
     }
 
-    const size_t n = m->nforms + 1;
-    struct form *const forms = realloc(m->forms, n * sizeof *m->forms);
-
-    if (!forms)
+    else if (!(m->forms = arena_append(&ctx->arena, m->forms, m->nforms,
+        sizeof *m->forms)))
     {
-        fprintf(stderr, "%s: realloc(3): %s\n", __func__, strerror(errno));
+        fprintf(stderr, "%s: arena_append failed\n", __func__);
         return -1;
     }
 
-    struct form *const f = &forms[m->nforms];
+    struct form *const f = &m->forms[m->nforms++];
 
     *f = (const struct form){0};
-    m->nforms = n;
-    m->forms = forms;
     return cd_fields(h, f, sep);
 }
 
-static int mf_header_cr_line(struct http_ctx *const h)
+/* Builds the bad character table used by find_boundary, so that it is
+ * only computed once per request. Shifts are clamped so that they fit
+ * into a byte, which is always safe since it only makes them shorter. */
+static int prepare_boundary(struct http_ctx *const h)
 {
+    enum {SKIP_MAX = UCHAR_MAX};
     struct ctx *const c = &h->ctx;
     struct multiform *const m = &c->u.mf;
-    const char *const line = h->line;
+    const size_t len = strlen(c->boundary), last = len - 1;
+    unsigned char *const skip = arena_alloc(&c->arena, UCHAR_MAX + 1);
+
+    if (!skip)
+    {
+        fprintf(stderr, "%s: arena_alloc failed\n", __func__);
+        return -1;
+    }
 
-    m->len += strlen(line) + strlen("\r\n");
+    memset(skip, len > SKIP_MAX ? SKIP_MAX : len, UCHAR_MAX + 1);
 
-    if (!*line)
+    for (size_t i = 0; i < last; i++)
     {
-        const size_t n = strlen("\r\n") + strlen(c->boundary) + 1;
+        const size_t shift = last - i;
+
+        skip[(unsigned char)c->boundary[i]] =
+            shift > SKIP_MAX ? SKIP_MAX : shift;
+    }
+
+    m->skip = skip;
+    m->clen = len;
+    return 0;
+}
 
-        if (!m->boundary && !(m->boundary = calloc(1, n)))
+static int mf_header_cr_line(struct http_ctx *const h)
+{
+    struct ctx *const c = &h->ctx;
+    struct multiform *const m = &c->u.mf;
+    const char *const line = h->b->line;
+
+    m->len += c->len + strlen("\r\n");
+
+    if (!c->len)
+    {
+        if (!m->skip && prepare_boundary(h))
         {
-            fprintf(stderr, "%s: malloc(3): %s\n", __func__, strerror(errno));
+            fprintf(stderr, "%s: prepare_boundary failed\n", __func__);
             return -1;
         }
 
@@ -1521,7 +2136,7 @@ static int mf_header_cr_line(struct http_ctx *const h)
 
     const char *value;
     size_t n;
-    int ret = get_field_value(line, &n, &value);
+    int ret = get_field_value(line, c->len, &n, &value);
 
     if (ret)
         return ret;
@@ -1534,7 +2149,7 @@ static int mf_header_cr_line(struct http_ctx *const h)
 
 static int end_boundary_line(struct http_ctx *const h)
 {
-    const char *const line = h->line;
+    const char *const line = h->b->line;
 
     if (!*line)
     {
@@ -1583,60 +2198,101 @@ static int process_mf_line(struct http_ctx *const h)
         [MF_END_BOUNDARY_CR_LINE] = end_boundary_line
     };
 
-    h->ctx.payload.read += strlen(h->line) + strlen("\r\n");
+    h->ctx.payload.read += strlen(h->b->line) + strlen("\r\n");
     return state[h->ctx.u.mf.state](h);
 }
 
-static char *get_tmp(const char *const tmpdir)
+static char *get_tmp(struct http_ctx *const h)
 {
-    struct dynstr d;
+    static const char suffix[] = "/tmp.XXXXXX";
+    const char *const tmpdir = h->cfg.tmpdir;
 
-    dynstr_init(&d);
+    if (!tmpdir)
+    {
+        fprintf(stderr, "%s: no temporary directory defined\n", __func__);
+        return NULL;
+    }
 
-    if (dynstr_append(&d, "%s/tmp.XXXXXX", tmpdir))
+    const size_t n = strlen(tmpdir);
+    char *const ret = arena_alloc(&h->ctx.arena, n + sizeof suffix);
+
+    if (!ret)
     {
-        fprintf(stderr, "%s: dynstr_append failed\n", __func__);
+        fprintf(stderr, "%s: arena_alloc failed\n", __func__);
         return NULL;
     }
 
-    return d.str;
+    memcpy(ret, tmpdir, n);
+    memcpy(ret + n, suffix, sizeof suffix);
+    return ret;
 }
 
-static int generate_mf_file(struct http_ctx *const h)
+/* Creates a temporary file into cfg.tmpdir. If cfg.anon_tmp is set, the
+ * file has no name, so that it is removed by the system once closed,
+ * unless linked by the application with http_link_tmp(3). Otherwise, its
+ * name is assigned to *tmpname. */
+static int open_tmp(struct http_ctx *const h, char **const tmpname)
 {
-    struct multiform *const m = &h->ctx.u.mf;
-    struct form *const f = &m->forms[m->nforms - 1];
+    const bool anon = h->cfg.anon_tmp;
+    char *name;
+    int fd;
+
+    *tmpname = NULL;
+
+#ifdef O_TMPFILE
+    if (anon && h->cfg.tmpdir)
+    {
+        if ((fd = open(h->cfg.tmpdir, O_TMPFILE | O_RDWR | O_CLOEXEC,
+            S_IRUSR | S_IWUSR)) >= 0)
+            return fd;
+        /* Not every file system supports O_TMPFILE. */
+        else if (errno != EOPNOTSUPP && errno != EISDIR)
+        {
+            fprintf(stderr, "%s: open(2) %s: %s\n",
+                __func__, h->cfg.tmpdir, strerror(errno));
+            return -1;
+        }
+    }
+#endif
 
-    if (!(f->tmpname = get_tmp(h->cfg.tmpdir)))
+    if (!(name = get_tmp(h)))
     {
         fprintf(stderr, "%s: get_tmp failed\n", __func__);
         return -1;
     }
-    else if ((m->fd = mkstemp(f->tmpname)) < 0)
+    else if ((fd = mkstemp(name)) < 0)
     {
         fprintf(stderr, "%s: mkstemp(3): %s\n", __func__, strerror(errno));
         return -1;
     }
+    else if (anon && unlink(name))
+    {
+        fprintf(stderr, "%s: unlink(2) %s: %s\n",
+            __func__, name, strerror(errno));
 
-    return 0;
+        if (close(fd))
+            fprintf(stderr, "%s: close(2): %s\n", __func__, strerror(errno));
+
+        return -1;
+    }
+
+    if (!anon)
+        *tmpname = name;
+
+    return fd;
 }
 
-static int read_mf_body_to_mem(struct http_ctx *const h, const void *const buf,
-    const size_t n)
+static int generate_mf_file(struct http_ctx *const h)
 {
-    struct ctx *const c = &h->ctx;
-    struct multiform *const m = &c->u.mf;
+    struct multiform *const m = &h->ctx.u.mf;
+    struct form *const f = &m->forms[m->nforms - 1];
 
-    if (m->written + n > sizeof h->line)
+    if ((m->fd = open_tmp(h, &f->tmpname)) < 0)
     {
-        fprintf(stderr, "%s: maximum length exceeded\n", __func__);
-        return 1;
+        fprintf(stderr, "%s: open_tmp failed\n", __func__);
+        return -1;
     }
 
-    memcpy(&h->line[m->written], buf, n);
-    m->written += n;
-    m->len += n;
-    c->payload.read += n;
     return 0;
 }
 
@@ -1664,67 +2320,165 @@ static int read_mf_body_to_file(struct http_ctx *const h, const void *const buf,
     return 0;
 }
 
-static int reset_boundary(struct http_ctx *const h)
+static size_t max_field(const struct http_ctx *const h)
+{
+    const size_t n = h->cfg.max_field;
+
+    return n ? n : sizeof h->b->line;
+}
+
+static char *field_data(const struct http_ctx *const h)
+{
+    const struct multiform *const m = &h->ctx.u.mf;
+
+    return m->field ? m->field : h->b->line;
+}
+
+/* Fields are stored into the line buffer, unless they do not fit. Then,
+ * they are moved into a buffer that is grown as needed, and kept until
+ * the end of the request so it can be reused by later fields. */
+static int grow_field(struct http_ctx *const h, const size_t n)
 {
     struct multiform *const m = &h->ctx.u.mf;
-    struct form *const f = &m->forms[m->nforms - 1];
-    int (*const read_mf)(struct http_ctx *, const void *, size_t) =
-            f->filename ? read_mf_body_to_file : read_mf_body_to_mem;
-    const size_t len = strlen(m->boundary);
-    const int res = read_mf(h, m->boundary, len);
+    const size_t cur = m->field ? m->fsize : sizeof h->b->line,
+        max = max_field(h);
 
-    if (res)
-        return res;
+    if (n <= cur)
+        return 0;
 
-    memset(m->boundary, '\0', len);
-    m->blen = 0;
+    size_t size = cur > max / 2 ? max : cur * 2;
+
+    if (size < n)
+        size = n;
+
+    char *const field = realloc(m->field, size);
+
+    if (!field)
+    {
+        fprintf(stderr, "%s: realloc(3): %s\n", __func__, strerror(errno));
+        return -1;
+    }
+    else if (!m->field)
+        memcpy(field, h->b->line, m->written);
+
+    m->field = field;
+    m->fsize = size;
+    return 0;
+}
+
+/* If cfg.spill_fields is set, fields larger than cfg.max_field are
+ * written into a temporary file instead, and reported as files without
+ * a filename. */
+static int spill_field(struct http_ctx *const h, const void *const buf,
+    const size_t n)
+{
+    struct multiform *const m = &h->ctx.u.mf;
+    ssize_t res;
+
+    if (generate_mf_file(h))
+    {
+        fprintf(stderr, "%s: generate_mf_file failed\n", __func__);
+        return -1;
+    }
+    else if ((res = pwrite(m->fd, field_data(h), m->written, 0)) != m->written)
+    {
+        fprintf(stderr, "%s: pwrite(2): %s\n", __func__,
+            res < 0 ? strerror(errno) : "short write");
+        return -1;
+    }
+
+    return read_mf_body_to_file(h, buf, n);
+}
+
+static int read_mf_body_to_mem(struct http_ctx *const h, const void *const buf,
+    const size_t n)
+{
+    struct ctx *const c = &h->ctx;
+    struct multiform *const m = &c->u.mf;
+    const size_t len = m->written + n;
+
+    if (len > max_field(h))
+    {
+        if (h->cfg.spill_fields)
+            return spill_field(h, buf, n);
+
+        fprintf(stderr, "%s: maximum length exceeded\n", __func__);
+        return 1;
+    }
+    else if (grow_field(h, len))
+    {
+        fprintf(stderr, "%s: grow_field failed\n", __func__);
+        return -1;
+    }
+
+    memcpy(&field_data(h)[m->written], buf, n);
+    m->written += n;
+    m->len += n;
+    c->payload.read += n;
     return 0;
 }
 
+/* Spilled fields have a temporary file, but no filename. */
+static bool is_file(const struct multiform *const m,
+    const struct form *const f)
+{
+    return f->filename || m->fd >= 0;
+}
+
 static int dump_body(struct http_ctx *const h, const void *const buf,
     const size_t n)
 {
     struct multiform *const m = &h->ctx.u.mf;
     struct form *const f = &m->forms[m->nforms - 1];
     int (*const read_mf)(struct http_ctx *, const void *, size_t) =
-            f->filename ? read_mf_body_to_file : read_mf_body_to_mem;
+            is_file(m, f) ? read_mf_body_to_file : read_mf_body_to_mem;
 
     return read_mf(h, buf, n);
 }
 
+/* Bytes from a partial match are always a prefix of the boundary, so
+ * they are not stored anywhere else. */
+static int reset_boundary(struct http_ctx *const h)
+{
+    struct multiform *const m = &h->ctx.u.mf;
+    const int res = dump_body(h, h->ctx.boundary, m->blen);
+
+    m->blen = 0;
+    return res;
+}
+
 static int apply_from_file(struct http_ctx *const h, struct form *const f)
 {
     struct multiform *const m = &h->ctx.u.mf;
+    struct http_post_file *const files = arena_append(&h->ctx.arena,
+        m->files, m->nfiles, sizeof *m->files);
 
-    if (close(m->fd))
+    if (!files)
     {
-        fprintf(stderr, "%s: close(2): %s\n", __func__, strerror(errno));
+        fprintf(stderr, "%s: arena_append failed\n", __func__);
         return -1;
     }
 
-    m->fd = -1;
-
-    const size_t n = m->nfiles + 1;
-    struct http_post_file *const files = realloc(m->files,
-        n * sizeof *m->files);
+    /* Anonymous files can only be reached through their descriptor, so
+     * it is kept open until the request is freed. */
+    const int fd = h->cfg.anon_tmp ? m->fd : -1;
 
-    if (!files)
+    if (fd < 0 && close(m->fd))
     {
-        fprintf(stderr, "%s: realloc(3): %s\n", __func__, strerror(errno));
+        fprintf(stderr, "%s: close(2): %s\n", __func__, strerror(errno));
         return -1;
     }
 
-    struct http_post_file *const pf = &files[m->nfiles];
-
-    *pf = (const struct http_post_file)
+    m->fd = -1;
+    files[m->nfiles++] = (const struct http_post_file)
     {
         .name = f->name,
         .tmpname = f->tmpname,
-        .filename = f->filename
+        .filename = f->filename,
+        .fd = fd
     };
 
     m->files = files;
-    m->nfiles = n;
     return 0;
 }
 
@@ -1748,22 +2502,23 @@ static bool name_exists(const struct multiform *const m,
 
 static int apply_from_mem(struct http_ctx *const h, struct form *const f)
 {
-    struct multiform *const m = &h->ctx.u.mf;
+    struct ctx *const c = &h->ctx;
+    struct multiform *const m = &c->u.mf;
 
     if (name_exists(m, f))
         return 1;
 
-    struct http_post_pair *pairs, *p;
-    const size_t n = m->npairs + 1;
+    struct http_post_pair *pairs;
 
-    if (!(f->value = strndup(h->line, m->written)))
+    if (!(f->value = arena_strndup(&c->arena, field_data(h), m->written)))
     {
-        fprintf(stderr, "%s: strndup(3): %s\n", __func__, strerror(errno));
+        fprintf(stderr, "%s: arena_strndup failed\n", __func__);
         return -1;
     }
-    else if (!(pairs = realloc(m->pairs, n * sizeof *m->pairs)))
+    else if (!(pairs = arena_append(&c->arena, m->pairs, m->npairs,
+        sizeof *m->pairs)))
     {
-        fprintf(stderr, "%s: realloc(3): %s\n", __func__, strerror(errno));
+        fprintf(stderr, "%s: arena_append failed\n", __func__);
         return -1;
     }
 
@@ -1777,136 +2532,197 @@ static int apply_from_mem(struct http_ctx *const h, struct form *const f)
     return 0;
 }
 
-static int read_mf_body_boundary_byte(struct http_ctx *const h, const char b,
-    const size_t len)
+static int end_part(struct http_ctx *const h)
 {
-    struct ctx *const c = &h->ctx;
-    struct multiform *const m = &c->u.mf;
-    const size_t clen = strlen(c->boundary);
+    struct multiform *const m = &h->ctx.u.mf;
+    struct form *const f = &m->forms[m->nforms - 1];
+    const int ret = is_file(m, f) ? apply_from_file(h, f)
+        : apply_from_mem(h, f);
+
+    /* Unlike the rest of the body, the boundary is never dumped, so it
+     * must be accounted here. */
+    h->ctx.payload.read += m->clen;
+    m->state = MF_END_BOUNDARY_CR_LINE;
+    m->written = 0;
+    return ret;
+}
+
+/* Returns the offset to the first occurrence of the boundary inside buf,
+ * or n if not found, according to the Boyer-Moore-Horspool algorithm. */
+static size_t find_boundary(const struct ctx *const c, const char *const buf,
+    const size_t n)
+{
+    const struct multiform *const m = &c->u.mf;
+    const unsigned char *const skip = m->skip;
+    const size_t len = m->clen, last = len - 1;
+    const char *const b = c->boundary, lc = b[last];
 
-    if (b == c->boundary[m->blen])
+    for (size_t i = 0; n >= len && i <= n - len;)
     {
-        m->boundary[m->blen++] = b;
+        const char bc = buf[i + last];
 
-        if (m->blen >= clen)
-        {
-            /* Found intermediate boundary. */
-            struct form *const f = &m->forms[m->nforms - 1];
-            const int ret = f->filename ? apply_from_file(h, f)
-                : apply_from_mem(h, f);
+        if (bc == lc && !memcmp(&buf[i], b, last))
+            return i;
 
-            memset(m->boundary, '\0', clen);
-            m->blen = 0;
-            m->state = MF_END_BOUNDARY_CR_LINE;
-            m->written = 0;
-            return ret;
-        }
-    }
-    else
-    {
-        fprintf(stderr, "%s: expected %hhx, got %hhx\n", __func__,
-            c->boundary[m->blen], b);
-        return 1;
+        i += skip[(unsigned char)bc];
     }
 
-    return 0;
+    return n;
 }
 
-/* Similar to memmem(3), provided here to avoid the use of GNU extensions. */
-static const char *http_memmem(const char *const a, const void *const b,
+/* Returns the offset to the longest suffix of buf that is also a prefix
+ * of the boundary, or n if none. Since the boundary cannot contain CR
+ * other than its first character, only the last CR must be checked. */
+static size_t find_partial(const struct ctx *const c, const char *const buf,
     const size_t n)
 {
-    const char *s = a, *st = NULL;
-
-    for (size_t i = 0; i < n; i++)
-    {
-        const char *bc = b;
-        const char c = bc[i];
-
-        if (*s == c)
-        {
-            if (!st)
-                st = &bc[i];
-
-            if (!*++s)
-                return st;
-        }
-        else if (*(s = a) != c)
-            st = NULL;
-        else
-        {
-            st = &bc[i];
+    const size_t last = c->u.mf.clen - 1, start = n > last ? n - last : 0;
 
-            if (!*++s)
-                return st;
-        }
-    }
+    for (size_t i = n; i > start; i--)
+        if (buf[i - 1] == '\r')
+            return memcmp(&buf[i - 1], c->boundary, n - i + 1) ? n : i - 1;
 
-    return st;
+    return n;
 }
 
 static int read_mf_body_boundary(struct http_ctx *const h,
     const char **const buf, size_t *const n)
 {
-    const char *orig_buf = *buf;
-    const size_t orig_n = *n;
     struct ctx *const c = &h->ctx;
     struct multiform *const m = &c->u.mf;
     int res;
 
-    if (m->blen
-        && **buf != c->boundary[m->blen]
-        && (res = reset_boundary(h)))
-        return res;
+    /* Resume any partial match from the previous read first. */
+    if (m->blen)
+    {
+        const size_t rem = m->clen - m->blen, r = rem > *n ? *n : rem;
 
-    const char *const boundary = http_memmem(&c->boundary[m->blen], *buf, *n);
+        if (!memcmp(*buf, &c->boundary[m->blen], r))
+        {
+            *buf += r;
+            *n -= r;
 
-    if (!boundary)
+            if ((m->blen += r) < m->clen)
+                return 0;
+
+            m->blen = 0;
+            return end_part(h);
+        }
+        else if ((res = reset_boundary(h)))
+            return res;
+    }
+
+    const size_t pos = find_boundary(c, *buf, *n);
+
+    if (pos < *n)
     {
-        if ((res = reset_boundary(h))
-            || (res = dump_body(h, *buf, *n)))
+        if ((res = dump_body(h, *buf, pos)))
             return res;
 
-        *n = 0;
-        return 0;
+        *buf += pos + m->clen;
+        *n -= pos + m->clen;
+        return end_part(h);
     }
 
-    const size_t prev = boundary - *buf;
+    /* Keep any trailing bytes that might belong to a boundary split
+     * across reads. */
+    const size_t partial = find_partial(c, *buf, *n);
 
-    if (prev && (res = reset_boundary(h)))
-        return res;
-    else if ((res = dump_body(h, *buf, prev)))
+    if ((res = dump_body(h, *buf, partial)))
         return res;
 
-    *buf += prev;
-    *n -= prev;
+    m->blen = *n - partial;
+    *buf += *n;
+    *n = 0;
+    return 0;
+}
 
-    const size_t len = strlen(m->boundary),
-        rem = strlen(c->boundary) - len,
-        r = rem > *n ? *n : rem;
+static size_t input_left(const struct http_ctx *const h)
+{
+    const struct buffer *const b = h->b;
 
-    for (size_t i = 0; i < r; i++)
-    {
-        const char *const b = *buf;
+    return b ? b->in.len - b->in.off : 0;
+}
 
-        if ((res = read_mf_body_boundary_byte(h, b[i], len)))
-            return res;
-    }
+static const char *input_data(const struct http_ctx *const h)
+{
+    const struct input *const in = &h->b->in;
 
-    *buf += r;
-    *n -= r;
-    return 0;
+    return &in->data[in->off];
+}
+
+static void consume_input(struct http_ctx *const h, const size_t n)
+{
+    struct input *const in = &h->b->in;
+
+    if ((in->off += n) >= in->len)
+        in->off = in->len = 0;
+}
+
+/* Returns the number of body bytes that can be read before the end of
+ * the payload or, for chunked bodies, the end of the current chunk. */
+static unsigned long long body_rem(const struct http_ctx *const h)
+{
+    const struct payload *const p = &h->ctx.payload;
+
+    return h->chunk.state != CHUNK_NONE ? h->chunk.left : p->len - p->read;
+}
+
+/* Returns how many body bytes should be read at once, which is never
+ * beyond the end of the payload or the current chunk, so that no bytes
+ * from a pipelined request are read along with the body. */
+static size_t read_size(const struct http_ctx *const h)
+{
+    const unsigned long long left = body_rem(h);
+    const size_t max = h->cfg.read_size ? h->cfg.read_size : READ_SIZE,
+        n = max > INT_MAX ? INT_MAX : max;
+
+    return left > n ? n : left;
+}
+
+static size_t body_left(const struct http_ctx *const h)
+{
+    const unsigned long long left = body_rem(h);
+    const size_t n = input_left(h);
+
+    return left > n ? n : left;
+}
+
+/* Chunked bodies are only complete once the last chunk has been
+ * decoded. */
+static bool body_done(const struct http_ctx *const h)
+{
+    const struct payload *const p = &h->ctx.payload;
+
+    return h->chunk.state == CHUNK_NONE && p->read >= p->len;
+}
+
+static void consume_chunk(struct http_ctx *const h, const size_t n)
+{
+    struct chunked *const ch = &h->chunk;
+
+    if (!(ch->left -= n))
+        ch->state = CHUNK_DATA_CR;
 }
 
-static int read_multiform_n(struct http_ctx *const h, bool *const close,
-    const char *buf, size_t n)
+static int read_multiform(struct http_ctx *const h, bool *const close)
 {
     struct multiform *const m = &h->ctx.u.mf;
+    const char *buf = input_data(h);
+    const size_t total = body_left(h);
+    size_t n = total;
+    int ret = 0;
 
-    while (n)
+    if (!total)
     {
-        int res;
+        fprintf(stderr, "%s: unexpected end of payload\n", __func__);
+        return 1;
+    }
 
+    /* Stop as soon as the payload is sent, since any remaining bytes
+     * belong to the next request. */
+    while (n && !h->wctx.pending)
+    {
         switch (m->state)
         {
             case MF_START_BOUNDARY:
@@ -1914,205 +2730,699 @@ static int read_multiform_n(struct http_ctx *const h, bool *const close,
             case MF_HEADER_CR_LINE:
                 /* Fall through. */
             case MF_END_BOUNDARY_CR_LINE:
-            {
-                if ((res = update_lstate(h, close, process_mf_line, *buf)))
-                    return res;
-
-                buf++;
-                n--;
-            }
+                if ((ret = update_lstate(h, close, process_mf_line, &buf, &n)))
+                    goto end;
 
                 break;
 
             case MF_BODY_BOUNDARY_LINE:
-                if ((res = read_mf_body_boundary(h, &buf, &n)))
-                    return res;
+                if ((ret = read_mf_body_boundary(h, &buf, &n)))
+                    goto end;
         }
     }
 
-    return 0;
+end:
+    consume_input(h, total - n);
+    return ret;
 }
 
-static int read_multiform(struct http_ctx *const h, bool *const close)
+static int end_body_to_mem(struct http_ctx *const h)
 {
-    /* Note: the larger the buffer below, the less CPU load. */
-    char buf[sizeof h->line];
-    struct payload *const p = &h->ctx.payload;
-    const unsigned long long left = p->len - p->read;
-    const size_t rem = left > sizeof buf ? sizeof buf : left;
-    const int r = h->cfg.read(buf, rem, h->cfg.user);
+    struct ctx *const c = &h->ctx;
+    const struct http_payload pl =
+    {
+        .cookie =
+        {
+            .field = c->field,
+            .value = c->value
+        },
 
-    if (r <= 0)
-        return rw_error(r, close);
+        .op = c->op,
+        .resource = c->resource,
+        .u.post =
+        {
+            .data = h->b->line
+        }
+    };
 
-    return read_multiform_n(h, close, buf, r);
+    h->b->line[c->payload.read] = '\0';
+    return send_payload(h, &pl);
 }
 
 static int read_body_to_mem(struct http_ctx *const h, bool *const close)
 {
-    char b;
-    const int r = h->cfg.read(&b, sizeof b, h->cfg.user);
+    struct ctx *const c = &h->ctx;
+    struct payload *const p = &c->payload;
+    const size_t n = body_left(h);
+
+    if (p->read + n >= sizeof h->b->line)
+    {
+        fprintf(stderr, "%s: exceeded maximum length\n", __func__);
+        return 1;
+    }
+
+    memcpy(&h->b->line[p->read], input_data(h), n);
+    consume_input(h, n);
+    p->read += n;
+    return body_done(h) ? end_body_to_mem(h) : 0;
+}
+
+/* The length of the body is only a hint, so any errors are ignored. */
+static void preallocate(const int fd, const off_t len)
+{
+#ifdef __linux__
+    /* Unlike posix_fallocate(3), the file size is kept, and no data is
+     * written if the file system does not support preallocation. */
+    fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, len);
+#else
+    posix_fallocate(fd, 0, len);
+#endif
+}
+
+static int open_put_file(struct http_ctx *const h)
+{
+    const struct ctx *const c = &h->ctx;
+    struct put *const put = &h->ctx.u.put;
+
+    if (put->fd >= 0)
+        return 0;
+    else if ((put->fd = open_tmp(h, &put->tmpname)) < 0)
+    {
+        fprintf(stderr, "%s: open_tmp failed\n", __func__);
+        return -1;
+    }
+    else if (!c->chunked && c->payload.len)
+        preallocate(put->fd, c->payload.len);
+
+    return 0;
+}
+
+static int end_put(struct http_ctx *const h)
+{
+    struct ctx *const c = &h->ctx;
+    const struct http_payload pl =
+    {
+        .cookie =
+        {
+            .field = c->field,
+            .value = c->value
+        },
+
+        .op = c->op,
+        .resource = c->resource,
+        .u.put =
+        {
+            .tmpname = c->u.put.tmpname,
+            .fd = h->cfg.anon_tmp ? c->u.put.fd : -1
+        }
+    };
+
+    return send_payload(h, &pl);
+}
+
+static int read_to_file(struct http_ctx *const h, bool *const close)
+{
+    struct ctx *const c = &h->ctx;
+    struct payload *const p = &c->payload;
+    const size_t n = body_left(h);
+    ssize_t res;
+
+    if (open_put_file(h))
+    {
+        fprintf(stderr, "%s: open_put_file failed\n", __func__);
+        return -1;
+    }
+    else if ((res = pwrite(c->u.put.fd, input_data(h), n, p->read)) < 0)
+    {
+        fprintf(stderr, "%s: pwrite(2): %s\n", __func__, strerror(errno));
+        return -1;
+    }
+
+    /* Any bytes not written yet are kept for the next call. */
+    consume_input(h, res);
+    p->read += res;
+    return body_done(h) ? end_put(h) : 0;
+}
+
+/* Moves the body from the client into the file without going through
+ * the input buffer, which must be empty. */
+static int splice_to_file(struct http_ctx *const h, bool *const close,
+    bool *const more)
+{
+    struct ctx *const c = &h->ctx;
+    struct payload *const p = &c->payload;
+    const size_t n = read_size(h);
+
+    if (open_put_file(h))
+    {
+        fprintf(stderr, "%s: open_put_file failed\n", __func__);
+        return -1;
+    }
+
+    const int r = h->cfg.splice(c->u.put.fd, p->read, n, h->cfg.user);
 
     if (r <= 0)
         return rw_error(r, close);
 
+    *more = (size_t)r == n;
+    p->read += r;
+
+    if (h->chunk.state == CHUNK_DATA)
+        consume_chunk(h, r);
+
+    return body_done(h) ? end_put(h) : 0;
+}
+
+/* Since the next read only occurs once the handler has returned, slow
+ * handlers make TCP flow control slow down the client, and memory usage
+ * is bounded by the input buffer. */
+static int read_stream(struct http_ctx *const h, bool *const close)
+{
     struct ctx *const c = &h->ctx;
-    struct payload *const p = &c->payload;
+    struct http_stream *const s = &c->stream;
+    struct http_payload p = ctx_to_payload(c);
+    const size_t n = body_left(h);
+    int ret;
 
-    if (p->read >= sizeof h->line - 1)
+    s->buf = input_data(h);
+    s->n = n;
+    p.stream = s;
+
+    if ((ret = h->cfg.payload(&p, &h->wctx.r, h->cfg.user)))
     {
-        fprintf(stderr, "%s: exceeded maximum length\n", __func__);
-        return 1;
+        /* The handler is not called again for this request. */
+        c->streaming = false;
+
+        if (ret < 0)
+        {
+            fprintf(stderr, "%s: payload failed\n", __func__);
+            return ret;
+        }
+
+        h->wctx.close = true;
+        return start_response(h);
+    }
+
+    consume_input(h, n);
+    c->payload.read += n;
+    return body_done(h) ? end_stream(h) : 0;
+}
+
+static int read_body(struct http_ctx *const h, bool *const close)
+{
+    const struct ctx *const c = &h->ctx;
+
+    if (c->streaming)
+        return read_stream(h, close);
+
+    switch (c->op)
+    {
+        case HTTP_OP_POST:
+            return c->boundary ? read_multiform(h, close)
+            : read_body_to_mem(h, close);
+
+        case HTTP_OP_PUT:
+            return read_to_file(h, close);
+
+        case HTTP_OP_GET:
+            /* Fall through. */
+        case HTTP_OP_HEAD:
+            break;
+    }
+
+    fprintf(stderr, "%s: unexpected op %d\n", __func__, c->op);
+    return -1;
+}
+
+static int hex_digit(const char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    else if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+
+    return -1;
+}
+
+/* Chunks announced so far are accounted into the payload length, so
+ * that cfg.length can reject a chunked body as soon as it grows too
+ * large, even if its total length is not known in advance. */
+static int start_chunk(struct http_ctx *const h)
+{
+    struct ctx *const c = &h->ctx;
+    struct chunked *const ch = &h->chunk;
+    int res;
+
+    ch->state = CHUNK_DATA;
+
+    if (c->state != BODY_LINE)
+        return 0;
+
+    c->payload.len += ch->left;
+
+    if ((res = check_length(h)))
+    {
+        if (res < 0)
+        {
+            fprintf(stderr, "%s: check_length failed\n", __func__);
+            return res;
+        }
+
+        h->wctx.close = true;
+        return start_response(h);
+    }
+
+    return 0;
+}
+
+static int chunk_byte(struct http_ctx *const h, const char b)
+{
+    struct chunked *const ch = &h->chunk;
+
+    switch (ch->state)
+    {
+        case CHUNK_SIZE:
+        {
+            const int d = hex_digit(b);
+
+            if (d >= 0)
+            {
+                if (ch->left > ULLONG_MAX >> 4)
+                {
+                    fprintf(stderr, "%s: chunk size too large\n", __func__);
+                    return 1;
+                }
+
+                ch->left = ch->left << 4 | d;
+                ch->digits = true;
+                return 0;
+            }
+            else if (!ch->digits)
+                break;
+            else if (b == ';')
+                ch->state = CHUNK_EXT;
+            else if (b == '\r')
+                ch->state = CHUNK_SIZE_LF;
+            else
+                break;
+
+            return 0;
+        }
+
+        case CHUNK_EXT:
+            /* Chunk extensions are ignored. */
+            if (b == '\r')
+                ch->state = CHUNK_SIZE_LF;
+
+            return 0;
+
+        case CHUNK_SIZE_LF:
+            if (b != '\n')
+                break;
+            else if (ch->left)
+                return start_chunk(h);
+
+            ch->state = CHUNK_TRAILER;
+            ch->empty = true;
+            return 0;
+
+        case CHUNK_DATA_CR:
+            if (b != '\r')
+                break;
+
+            ch->state = CHUNK_DATA_LF;
+            return 0;
+
+        case CHUNK_DATA_LF:
+            if (b != '\n')
+                break;
+
+            *ch = (const struct chunked){.state = CHUNK_SIZE};
+            return 0;
+
+        case CHUNK_TRAILER:
+            /* Trailer fields are ignored. */
+            if (b == '\r')
+                ch->state = CHUNK_TRAILER_LF;
+            else
+                ch->empty = false;
+
+            return 0;
+
+        case CHUNK_TRAILER_LF:
+            if (b != '\n')
+                break;
+            else if (ch->empty)
+                ch->state = CHUNK_NONE;
+            else
+            {
+                ch->state = CHUNK_TRAILER;
+                ch->empty = true;
+            }
+
+            return 0;
+
+        case CHUNK_NONE:
+            /* Fall through. */
+        case CHUNK_DATA:
+            fprintf(stderr, "%s: unexpected state %d\n", __func__, ch->state);
+            return -1;
+    }
+
+    fprintf(stderr, "%s: unexpected byte %hhx in state %d\n",
+        __func__, b, ch->state);
+    return 1;
+}
+
+static int end_chunked(struct http_ctx *const h)
+{
+    const struct ctx *const c = &h->ctx;
+
+    if (c->streaming)
+        return end_stream(h);
+
+    switch (c->op)
+    {
+        case HTTP_OP_POST:
+            if (c->boundary)
+            {
+                fprintf(stderr, "%s: unexpected end of payload\n", __func__);
+                return 1;
+            }
+
+            return end_body_to_mem(h);
+
+        case HTTP_OP_PUT:
+            return end_put(h);
+
+        case HTTP_OP_GET:
+            /* Fall through. */
+        case HTTP_OP_HEAD:
+            break;
+    }
+
+    fprintf(stderr, "%s: unexpected op %d\n", __func__, c->op);
+    return -1;
+}
+
+/* Chunk data is handed to the usual body readers, limited to the end of
+ * the current chunk by body_left, whereas everything else is decoded
+ * here. If the payload has already been sent, as it happens once the
+ * end boundary of a multipart/form-data body is found, the rest of the
+ * body is discarded. */
+static int read_chunked(struct http_ctx *const h, bool *const close)
+{
+    struct chunked *const ch = &h->chunk;
+    const bool body = h->ctx.state == BODY_LINE;
+
+    if (ch->state == CHUNK_DATA)
+    {
+        const size_t n = input_left(h);
+        int ret = 0;
+
+        if (body)
+            ret = read_body(h, close);
+        else
+            consume_input(h, body_left(h));
+
+        consume_chunk(h, n - input_left(h));
+        return ret;
+    }
+
+    const char *const buf = input_data(h);
+    const size_t n = input_left(h);
+    size_t i = 0;
+    int ret = 0;
+
+    while (i < n && ch->state != CHUNK_DATA && ch->state != CHUNK_NONE)
+        if ((ret = chunk_byte(h, buf[i++])))
+            break;
+
+    consume_input(h, i);
+
+    if (ret)
+        return ret;
+    else if (ch->state == CHUNK_NONE && body)
+        return end_chunked(h);
+
+    return 0;
+}
+
+static int process_line(struct http_ctx *const h)
+{
+    static int (*const state[])(struct http_ctx *) =
+    {
+        [START_LINE] = start_line,
+        [HEADER_CR_LINE] = header_cr_line
+    };
+
+    return state[h->ctx.state](h);
+}
+
+/* Responses with a small, in-memory body are appended to the output
+ * buffer instead of being written, as long as more requests are already
+ * waiting to be processed or previous responses have not been sent yet.
+ * Otherwise, they are written on their own once the output buffer has
+ * been flushed, so that the order of responses is preserved. */
+static bool can_queue(const struct http_ctx *const h)
+{
+    const struct write_ctx *const w = &h->wctx;
+    const struct http_response *const r = &w->r;
+    const struct output *const o = &h->b->out;
+    const size_t room = sizeof o->buf - o->len;
+    const unsigned long long n = must_write_body(w) ? r->n : 0;
+
+    return w->pending && !w->close && !r->f && !r->chunk
+        && (!n || r->buf.ro) && (input_left(h) || o->len)
+        && w->d.len <= room && n <= room - w->d.len;
+}
+
+static int queue_response(struct http_ctx *const h, bool *const close)
+{
+    const struct write_ctx *const w = &h->wctx;
+    const struct http_response *const r = &w->r;
+    struct output *const o = &h->b->out;
+
+    memcpy(o->buf + o->len, w->d.str, w->d.len);
+    o->len += w->d.len;
+
+    if (must_write_body(w) && r->n)
+    {
+        memcpy(o->buf + o->len, r->buf.ro, r->n);
+        o->len += r->n;
     }
 
-    h->line[p->read++] = b;
+    return end_response(h, close);
+}
 
-    if (p->read >= p->len)
+static int process_input(struct http_ctx *const h, bool *const close)
+{
+    while (input_left(h) && !h->wctx.pending)
     {
-        const struct http_payload pl =
+        int ret;
+
+        if (h->chunk.state != CHUNK_NONE)
+            ret = read_chunked(h, close);
+        else
         {
-            .cookie =
+            switch (h->ctx.state)
             {
-                .field = c->field,
-                .value = c->value
-            },
+                case START_LINE:
+                    /* Fall through. */
+                case HEADER_CR_LINE:
+                {
+                    const char *buf = input_data(h);
+                    const size_t left = input_left(h);
+                    size_t n = left;
 
-            .op = c->op,
-            .resource = c->resource,
-            .u.post =
-            {
-                .data = h->line
+                    ret = update_lstate(h, close, process_line, &buf, &n);
+                    consume_input(h, left - n);
+                }
+                    break;
+
+                case BODY_LINE:
+                    ret = read_body(h, close);
+                    break;
+
+                default:
+                    fprintf(stderr, "%s: unexpected state %d\n",
+                        __func__, h->ctx.state);
+                    return -1;
             }
-        };
+        }
 
-        h->line[p->len] = '\0';
-        return send_payload(h, &pl);
+        if (ret || (can_queue(h) && (ret = queue_response(h, close))))
+            return ret;
     }
 
     return 0;
 }
 
-static int read_put_body_to_file(struct http_ctx *const h,
-    const void *const buf, const size_t n)
+static struct buffer *get_buffer(struct http_pool *const p)
 {
-    struct ctx *const c = &h->ctx;
-    struct put *const put = &c->u.put;
-    ssize_t res;
+    struct buffer *ret;
 
-    if (!put->tmpname && !(put->tmpname = get_tmp(h->cfg.tmpdir)))
-    {
-        fprintf(stderr, "%s: get_tmp failed\n", __func__);
-        return -1;
-    }
-    else if (put->fd < 0 && (put->fd = mkstemp(put->tmpname)) < 0)
+    if (p && p->buffers)
     {
-        fprintf(stderr, "%s: mkstemp(3): %s\n", __func__, strerror(errno));
-        return -1;
+        ret = p->buffers;
+        p->buffers = ret->next;
+        p->n_buffers--;
     }
-    else if ((res = pwrite(put->fd, buf, n, c->payload.read)) < 0)
+    else if (!(ret = malloc(sizeof *ret)))
     {
-        fprintf(stderr, "%s: pwrite(2): %s\n", __func__, strerror(errno));
-        return -1;
+        fprintf(stderr, "%s: malloc(3): %s\n", __func__, strerror(errno));
+        return NULL;
     }
 
-    c->payload.read += res;
-    return 0;
+    ret->in.data = ret->in.buf;
+    ret->in.off = ret->in.len = 0;
+    ret->out.off = ret->out.len = 0;
+    return ret;
 }
 
-static int read_to_file(struct http_ctx *const h, bool *const close)
+static void put_buffer(struct http_pool *const p, struct buffer *const b)
 {
-    char buf[BUFSIZ];
-    struct ctx *const c = &h->ctx;
-    struct payload *const p = &c->payload;
-    const unsigned long long left = p->len - p->read;
-    const size_t rem = left > sizeof buf ? sizeof buf : left;
-    const int r = h->cfg.read(buf, rem, h->cfg.user);
+    if (p->n_buffers < p->max)
+    {
+        b->next = p->buffers;
+        p->buffers = b;
+        p->n_buffers++;
+    }
+    else
+        free(b);
+}
 
-    if (r <= 0)
-        return rw_error(r, close);
-    else if (read_put_body_to_file(h, buf, r))
-        return -1;
-    else if (p->read >= p->len)
+static void release_buffers(struct http_ctx *const h)
+{
+    if (h->b)
     {
-        const struct http_payload pl =
-        {
-            .cookie =
-            {
-                .field = c->field,
-                .value = c->value
-            },
+        put_buffer(h->cfg.pool, h->b);
+        h->b = NULL;
+    }
 
-            .op = c->op,
-            .resource = c->resource,
-            .u.put =
-            {
-                .tmpname = c->u.put.tmpname
-            }
-        };
+    arena_release(&h->ctx.arena);
+}
 
-        return send_payload(h, &pl);
-    }
+/* Chunked bodies can only be spliced while inside a chunk, since chunk
+ * sizes must be decoded from the input buffer. */
+static bool can_splice(const struct http_ctx *const h)
+{
+    const struct ctx *const c = &h->ctx;
+    const int state = h->chunk.state;
 
-    return 0;
+    return h->cfg.splice && c->state == BODY_LINE && c->op == HTTP_OP_PUT
+        && !c->streaming && (state == CHUNK_NONE || state == CHUNK_DATA);
 }
 
-static int read_body(struct http_ctx *const h, bool *const close)
+/* Large body reads go into a buffer shared by every connection from the
+ * pool, so that bodies can be read in fewer calls to cfg.read without
+ * making every connection allocate such a buffer. */
+static bool can_read_large(const struct http_ctx *const h)
 {
     const struct ctx *const c = &h->ctx;
+    const int state = h->chunk.state;
 
-    switch (c->op)
+    return h->cfg.pool && c->state == BODY_LINE
+        && (state == CHUNK_NONE || state == CHUNK_DATA)
+        && read_size(h) > sizeof h->b->in.buf;
+}
+
+static int read_large(struct http_ctx *const h, bool *const close,
+    bool *const more)
+{
+    struct http_pool *const p = h->cfg.pool;
+    struct input *const in = &h->b->in;
+    const size_t n = read_size(h);
+
+    if (p->read_size < n)
     {
-        case HTTP_OP_POST:
-            return c->boundary ? read_multiform(h, close)
-            : read_body_to_mem(h, close);
+        char *const buf = realloc(p->read_buf, n);
 
-        case HTTP_OP_PUT:
-            return read_to_file(h, close);
+        if (!buf)
+        {
+            fprintf(stderr, "%s: realloc(3): %s\n", __func__, strerror(errno));
+            return -1;
+        }
 
-        case HTTP_OP_GET:
-            /* Fall through. */
-        case HTTP_OP_HEAD:
-            break;
+        p->read_buf = buf;
+        p->read_size = n;
     }
 
-    fprintf(stderr, "%s: unexpected op %d\n", __func__, c->op);
-    return -1;
+    const int r = h->cfg.read(p->read_buf, n, h->cfg.user);
+
+    if (r <= 0)
+        return rw_error(r, close);
+
+    *more = (size_t)r == n;
+    in->data = p->read_buf;
+    in->off = 0;
+    in->len = r;
+
+    const int ret = process_input(h, close);
+    size_t left = input_left(h);
+
+    /* Bytes can only be left when a response is already on its way, e.g.
+     * after a multipart/form-data epilogue. Since the read buffer must be
+     * released, the connection is closed if they do not fit in buf. */
+    if (left > sizeof in->buf)
+    {
+        h->wctx.close = true;
+        left = 0;
+    }
+
+    memmove(in->buf, input_data(h), left);
+    in->data = in->buf;
+    in->off = 0;
+    in->len = left;
+    return ret;
 }
 
-static int process_line(struct http_ctx *const h)
+static int read_input(struct http_ctx *const h, bool *const close,
+    bool *const more)
 {
-    static int (*const state[])(struct http_ctx *) =
-    {
-        [START_LINE] = start_line,
-        [HEADER_CR_LINE] = header_cr_line
-    };
+    struct input *const in = &h->b->in;
 
-    return state[h->ctx.state](h);
+    if (input_left(h))
+        return process_input(h, close);
+    else if (can_splice(h))
+        return splice_to_file(h, close, more);
+    else if (can_read_large(h))
+        return read_large(h, close, more);
+
+    const int r = h->cfg.read(in->buf, sizeof in->buf, h->cfg.user);
+
+    if (r <= 0)
+        return rw_error(r, close);
+
+    *more = (size_t)r == sizeof in->buf;
+    in->off = 0;
+    in->len = r;
+    return process_input(h, close);
 }
 
 static int http_read(struct http_ctx *const h, bool *const close)
 {
-    switch (h->ctx.state)
+    if (!h->b && !(h->b = get_buffer(h->cfg.pool)))
     {
-        case START_LINE:
-            /* Fall through. */
-        case HEADER_CR_LINE:
-        {
-            char b;
-            const int r = h->cfg.read(&b, sizeof b, h->cfg.user);
-
-            if (r <= 0)
-                return rw_error(r, close);
+        fprintf(stderr, "%s: get_buffer failed\n", __func__);
+        return -1;
+    }
 
-            return update_lstate(h, close, process_line, b);
-        }
+    /* Bodies are read until the client runs out of data, as reported by
+     * a short read, instead of waiting for the next event. The number of
+     * reads is bounded so that other clients are not starved. */
+    for (int i = 0; i < MAX_READS; i++)
+    {
+        bool more = false;
+        const int ret = read_input(h, close, &more);
 
-        case BODY_LINE:
-            return read_body(h, close);
+        if (ret || *close || !more || http_phase(h) != HTTP_PHASE_BODY)
+            return ret;
     }
 
-    fprintf(stderr, "%s: unexpected state %d\n", __func__, h->ctx.state);
-    return -1;
+    return 0;
 }
 
 static int append_expire(struct dynstr *const d)
@@ -2151,6 +3461,87 @@ static int append_expire(struct dynstr *const d)
     return 0;
 }
 
+static int copy_tmp(const int fd, const char *const path)
+{
+    int ret = -1;
+    const int out = open(path, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+
+    if (out < 0)
+    {
+        fprintf(stderr, "%s: open(2) %s: %s\n",
+            __func__, path, strerror(errno));
+        return -1;
+    }
+
+    for (off_t off = 0;;)
+    {
+        char buf[BUFSIZ];
+        const ssize_t r = pread(fd, buf, sizeof buf, off);
+
+        if (r < 0)
+        {
+            fprintf(stderr, "%s: pread(2): %s\n", __func__, strerror(errno));
+            goto end;
+        }
+        else if (!r)
+            break;
+
+        for (ssize_t written = 0; written < r;)
+        {
+            const ssize_t w = write(out, buf + written, r - written);
+
+            if (w < 0)
+            {
+                fprintf(stderr, "%s: write(2): %s\n",
+                    __func__, strerror(errno));
+                goto end;
+            }
+
+            written += w;
+        }
+
+        off += r;
+    }
+
+    ret = 0;
+
+end:
+    if (close(out))
+    {
+        fprintf(stderr, "%s: close(2): %s\n", __func__, strerror(errno));
+        ret = -1;
+    }
+
+    if (ret && remove(path))
+        fprintf(stderr, "%s: remove(3) %s: %s\n",
+            __func__, path, strerror(errno));
+
+    return ret;
+}
+
+int http_link_tmp(const int fd, const char *const path)
+{
+#ifdef __linux__
+    /* Files created with O_TMPFILE can be given a name through procfs.
+     * Otherwise, as with files that were already removed or when path
+     * belongs to another file system, the contents are copied. */
+    char proc[sizeof "/proc/self/fd/" + 3 * sizeof fd];
+
+    snprintf(proc, sizeof proc, "/proc/self/fd/%d", fd);
+
+    if (!linkat(AT_FDCWD, proc, AT_FDCWD, path, AT_SYMLINK_FOLLOW))
+        return 0;
+    else if (errno != ENOENT && errno != EXDEV)
+    {
+        fprintf(stderr, "%s: linkat(2) %s: %s\n",
+            __func__, path, strerror(errno));
+        return -1;
+    }
+#endif
+
+    return copy_tmp(fd, path);
+}
+
 char *http_cookie_create(const char *const key, const char *const value)
 {
     struct dynstr d;
@@ -2171,19 +3562,66 @@ int http_update(struct http_ctx *const h, bool *const write, bool *const close)
 {
     *close = false;
 
-    struct write_ctx *const w = &h->wctx;
-    const int ret = w->pending ? http_write(h, close) : http_read(h, close);
+    int ret = 0;
+
+    if (!write_pending(h))
+        ret = http_read(h, close);
+
+    /* Responses are written as soon as they are ready, and requests
+     * already read from the client are processed once they have been
+     * sent, since no further events might come. This way, pipelined
+     * requests are answered back-to-back. */
+    while (!ret && !*close && write_pending(h))
+    {
+        if ((ret = http_write(h, close)) || *close || write_pending(h))
+            break;
+
+        ret = process_input(h, close);
+    }
+
+    /* Make a last attempt to send any responses to the requests that
+     * preceded an invalid one before the connection is closed. */
+    if (ret > 0 && output_left(h))
+    {
+        bool dummy;
+
+        write_output(h, &dummy);
+    }
+
+    *write = write_pending(h);
+
+    if (!ret && !*close && h->cfg.pool && http_phase(h) == HTTP_PHASE_IDLE)
+        release_buffers(h);
 
-    *write = w->pending;
     return ret;
 }
 
+void http_reset(struct http_ctx *const h)
+{
+    abort_stream(h);
+    ctx_free(&h->ctx);
+    write_ctx_free(&h->wctx);
+    h->chunk = (const struct chunked){0};
+
+    if (h->cfg.pool)
+        release_buffers(h);
+    else if (h->b)
+    {
+        h->b->in.data = h->b->in.buf;
+        h->b->in.off = h->b->in.len = 0;
+        h->b->out.off = h->b->out.len = 0;
+    }
+}
+
 void http_free(struct http_ctx *const h)
 {
     if (h)
     {
+        abort_stream(h);
         ctx_free(&h->ctx);
+        arena_free(&h->ctx.arena);
         write_ctx_free(&h->wctx);
+        free(h->b);
     }
 
     free(h);
@@ -2201,7 +3639,12 @@ struct http_ctx *http_alloc(const struct http_cfg *const cfg)
 
     *h = (const struct http_ctx)
     {
-        .cfg = *cfg
+        .cfg = *cfg,
+        .ctx.arena =
+        {
+            .chunk = cfg->arena_chunk ? cfg->arena_chunk : ARENA_CHUNK,
+            .pool = cfg->pool
+        }
     };
 
     return h;
@@ -2211,6 +3654,66 @@ failure:
     return NULL;
 }
 
+size_t http_arena_hwm(const struct http_ctx *const h)
+{
+    return h->ctx.arena.hwm;
+}
+
+enum http_phase http_phase(const struct http_ctx *const h)
+{
+    const struct ctx *const c = &h->ctx;
+
+    if (write_pending(h))
+        return HTTP_PHASE_WRITE;
+    else if (c->state == BODY_LINE || h->chunk.state != CHUNK_NONE)
+        return HTTP_PHASE_BODY;
+    else if (c->state == START_LINE && c->lstate == LINE_CR && !c->len
+        && !input_left(h))
+        return HTTP_PHASE_IDLE;
+
+    return HTTP_PHASE_HEADER;
+}
+
+void http_pool_free(struct http_pool *const p)
+{
+    if (p)
+    {
+        for (struct buffer *b = p->buffers; b;)
+        {
+            struct buffer *const next = b->next;
+
+            free(b);
+            b = next;
+        }
+
+        for (struct chunk *c = p->chunks; c;)
+        {
+            struct chunk *const next = c->next;
+
+            free(c);
+            c = next;
+        }
+
+        free(p->read_buf);
+    }
+
+    free(p);
+}
+
+struct http_pool *http_pool_alloc(const size_t max)
+{
+    struct http_pool *const p = malloc(sizeof *p);
+
+    if (!p)
+    {
+        fprintf(stderr, "%s: malloc(3): %s\n", __func__, strerror(errno));
+        return NULL;
+    }
+
+    *p = (const struct http_pool){.max = max};
+    return p;
+}
+
 char *http_encode_url(const char *url)
 {
     struct dynstr d;
@@ -2251,70 +3754,21 @@ failure:
 
 int http_decode_url(const char *url, const bool spaces, char **out)
 {
-    int ret = -1;
-    char *str = NULL;
-    size_t n = 0;
+    const size_t n = strlen(url);
+    char *const str = malloc(n + 1);
+    int ret;
 
-    while (*url)
+    if (!str)
     {
-        char *const r = realloc(str, n + 1);
-
-        if (!r)
-        {
-            fprintf(stderr, "%s: realloc(3) loop: %s\n",
-                __func__, strerror(errno));
-            goto end;
-        }
-
-        str = r;
-
-        if (spaces && *url == '+')
-        {
-            str[n++] = ' ';
-            url++;
-        }
-        else if (*url != '%')
-            str[n++] = *url++;
-        else if (*(url + 1) && *(url + 2))
-        {
-            const char buf[sizeof "00"] = {*(url + 1), *(url + 2)};
-            char *endptr;
-            const unsigned long res = strtoul(buf, &endptr, 16);
-
-            if (*endptr)
-            {
-                fprintf(stderr, "%s: invalid number %s\n", __func__, buf);
-                ret = 1;
-                goto end;
-            }
-
-            url += 3;
-            str[n++] = res;
-        }
-        else
-        {
-            fprintf(stderr, "%s: unterminated %%\n", __func__);
-            ret = 1;
-            goto end;
-        }
+        fprintf(stderr, "%s: malloc(3): %s\n", __func__, strerror(errno));
+        return -1;
     }
-
-    char *const r = realloc(str, n + 1);
-
-    if (!r)
+    else if ((ret = decode_url(url, n, spaces, str)))
     {
-        fprintf(stderr, "%s: realloc(3) end: %s\n", __func__, strerror(errno));
-        goto end;
+        free(str);
+        return ret;
     }
 
-    str = r;
-    str[n] = '\0';
     *out = str;
-    ret = 0;
-
-end:
-    if (ret)
-        free(str);
-
-    return ret;
+    return 0;
 }
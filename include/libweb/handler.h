@@ -13,13 +13,19 @@ struct handler_cfg
     int (*length)(unsigned long long len, const struct http_cookie *c,
         struct http_response *r, void *user);
     void *user;
-    size_t max_headers;
+    size_t max_headers, workers, arena_chunk, pool_warm, pool_max, max_accept,
+        read_size, max_field;
+    int backlog;
+    unsigned idle_timeout, header_timeout, body_timeout, write_timeout;
+    bool anon_tmp, spill_fields;
 };
 
 struct handler *handler_alloc(const struct handler_cfg *cfg);
 void handler_free(struct handler *h);
 int handler_add(struct handler *h, const char *url, enum http_op op,
     handler_fn f, void *user);
+int handler_add_stream(struct handler *h, const char *url, enum http_op op,
+    handler_fn f, void *user);
 int handler_listen(struct handler *h, unsigned short port,
     unsigned short *outport);
 int handler_loop(struct handler *h);
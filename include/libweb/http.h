@@ -1,6 +1,8 @@
 #ifndef HTTP_H
 #define HTTP_H
 
+#include <sys/types.h>
+#include <sys/uio.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -42,12 +44,14 @@ struct http_payload
             const struct http_post_file
             {
                 const char *name, *tmpname, *filename;
+                int fd;
             } *files;
         } post;
 
         struct http_put
         {
             const char *tmpname;
+            int fd;
         } put;
     } u;
 
@@ -58,6 +62,15 @@ struct http_payload
 
     size_t n_args, n_headers;
     const struct http_header *headers;
+
+    struct http_stream
+    {
+        const void *buf;
+        size_t n;
+        bool last, aborted;
+        void *state;
+    } *stream;
+
     bool expect_continue;
 };
 
@@ -93,27 +106,48 @@ struct http_response
     unsigned long long n;
     size_t n_headers;
     void (*free)(void *);
+    int (*chunk)(void *buf, size_t n, void *user);
+};
+
+enum http_phase
+{
+    HTTP_PHASE_IDLE,
+    HTTP_PHASE_HEADER,
+    HTTP_PHASE_BODY,
+    HTTP_PHASE_WRITE
 };
 
 struct http_cfg
 {
     int (*read)(void *buf , size_t n, void *user);
     int (*write)(const void *buf, size_t n, void *user);
+    int (*writev)(const struct iovec *iov, int n, void *user);
+    int (*sendfile)(int fd, off_t offset, size_t n, void *user);
+    int (*splice)(int fd, off_t offset, size_t n, void *user);
     int (*payload)(const struct http_payload *p, struct http_response *r,
         void *user);
     int (*length)(unsigned long long len, const struct http_cookie *c,
         struct http_response *r, void *user);
+    bool (*stream)(const struct http_payload *p, void *user);
     const char *tmpdir;
     void *user;
-    size_t max_headers;
+    size_t max_headers, arena_chunk, read_size, max_field;
+    struct http_pool *pool;
+    bool anon_tmp, spill_fields;
 };
 
 struct http_ctx *http_alloc(const struct http_cfg *cfg);
 void http_free(struct http_ctx *h);
+void http_reset(struct http_ctx *h);
 int http_update(struct http_ctx *h, bool *write, bool *close);
+size_t http_arena_hwm(const struct http_ctx *h);
+enum http_phase http_phase(const struct http_ctx *h);
+struct http_pool *http_pool_alloc(size_t max);
+void http_pool_free(struct http_pool *p);
 int http_response_add_header(struct http_response *r, const char *header,
     const char *value);
 char *http_cookie_create(const char *key, const char *value);
+int http_link_tmp(int fd, const char *path);
 char *http_encode_url(const char *url);
 int http_decode_url(const char *url, bool spaces, char **out);
 
@@ -0,0 +1,9 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+struct router *router_alloc(void);
+void router_free(struct router *r);
+int router_add(struct router *r, const char *pattern, void *user);
+void *router_match(const struct router *r, const char *s);
+
+#endif /* ROUTER_H */
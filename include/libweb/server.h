@@ -1,15 +1,41 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include <sys/types.h>
+#include <sys/uio.h>
 #include <stdbool.h>
 #include <stddef.h>
 
-struct server *server_init(unsigned short port, unsigned short *outport);
+struct server_cfg
+{
+    unsigned short port;
+    bool reuseport;
+    int backlog;
+    size_t pool_warm, pool_max, max_accept;
+};
+
+struct server_ready
+{
+    struct server_client *c;
+    bool io;
+};
+
+struct server *server_init(const struct server_cfg *cfg,
+    unsigned short *outport);
 struct server_client *server_poll(struct server *s, bool *io, bool *exit);
+const struct server_ready *server_poll_all(struct server *s, size_t *n,
+    int timeout, bool *exit);
 int server_read(void *buf, size_t n, struct server_client *c);
 int server_write(const void *buf, size_t n, struct server_client *c);
+int server_writev(const struct iovec *iov, int n, struct server_client *c);
+int server_sendfile(int fd, off_t offset, size_t n, struct server_client *c);
+int server_splice(int fd, off_t offset, size_t n, struct server *s,
+    struct server_client *c);
+int server_wake(struct server *s);
 int server_close(struct server *s);
 int server_client_close(struct server *s, struct server_client *c);
 void server_client_write_pending(struct server_client *c, bool write);
+void server_client_set_user(struct server_client *c, void *user);
+void *server_client_get_user(const struct server_client *c);
 
 #endif /* SERVER_H */
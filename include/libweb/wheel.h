@@ -0,0 +1,22 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <stdbool.h>
+
+struct wheel_timer
+{
+    unsigned long long expiry;
+    bool armed;
+    void *user;
+    struct wheel_timer *prev, *next;
+};
+
+struct wheel *wheel_alloc(unsigned long long now);
+void wheel_free(struct wheel *w);
+void wheel_add(struct wheel *w, struct wheel_timer *t,
+    unsigned long long expiry);
+void wheel_remove(struct wheel *w, struct wheel_timer *t);
+struct wheel_timer *wheel_expire(struct wheel *w, unsigned long long now);
+int wheel_timeout(const struct wheel *w, unsigned long long now);
+
+#endif /* WHEEL_H */
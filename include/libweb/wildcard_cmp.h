@@ -2,7 +2,20 @@
 #define WILDCARD_CMP_H
 
 #include <stdbool.h>
+#include <stddef.h>
 
+/* Every '*' from a pattern matches any sequence of characters, including
+ * an empty one, and every other character must match literally, so that
+ * the whole string must match the whole pattern. casecmp selects a
+ * case-sensitive comparison. Zero is returned on match.
+ *
+ * wildcard_cmp and wildcard_match share these semantics. Earlier versions
+ * of wildcard_cmp did not backtrack after a partial match, so some
+ * strings were wrongly rejected, such as "bbc" against "*bc", or
+ * "a.css.css" against "*.css". */
 int wildcard_cmp(const char *s, const char *p, bool casecmp);
+struct wildcard *wildcard_compile(const char *p, bool casecmp);
+int wildcard_match(const struct wildcard *w, const char *s, size_t n);
+void wildcard_free(struct wildcard *w);
 
 #endif /* WILDCARD_CMP_H */
@@ -0,0 +1,355 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "libweb/router.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Patterns are stored into a radix tree of their literal characters, both
+ * before and after every '*', and every '*' becomes a star node attached
+ * to the node that precedes it. A lookup follows the literal characters
+ * from the input string, and a star node tries every position from the
+ * input string where the pattern might continue.
+ *
+ * Since a star node can absorb any number of characters, only the
+ * leftmost position where it is reached is worth trying, so every star
+ * node is entered at most once per lookup. Therefore, the cost of a
+ * lookup depends on the length of the input string and on the shape of
+ * the tree, but not on the number of routes. */
+struct router
+{
+    struct node
+    {
+        char *label;
+        size_t len, n_children, id, prio, min_prio;
+        struct node **children, *star;
+        /* Set if a pattern ends at this node. */
+        bool route;
+        void *user;
+    } *root;
+
+    size_t n, n_stars;
+};
+
+/* Star nodes entered by a lookup are tracked by a bitmap on the stack.
+ * Star nodes beyond MAX_STARS are not tracked, so that they might be
+ * entered several times, which is slower but still correct. */
+enum {MAX_STARS = 1024, BITS = sizeof (unsigned long) * CHAR_BIT};
+
+struct match
+{
+    const struct node *best;
+    unsigned long seen[MAX_STARS / BITS];
+};
+
+static void node_free(struct node *const n)
+{
+    if (n)
+    {
+        for (size_t i = 0; i < n->n_children; i++)
+            node_free(n->children[i]);
+
+        node_free(n->star);
+        free(n->children);
+        free(n->label);
+    }
+
+    free(n);
+}
+
+static struct node *node_alloc(const char *const label, const size_t len,
+    const size_t prio)
+{
+    struct node *const ret = malloc(sizeof *ret);
+
+    if (!ret)
+    {
+        fprintf(stderr, "%s: malloc(3): %s\n", __func__, strerror(errno));
+        return NULL;
+    }
+
+    *ret = (const struct node)
+    {
+        .label = strndup(label, len),
+        .len = len,
+        .min_prio = prio
+    };
+
+    if (!ret->label)
+    {
+        fprintf(stderr, "%s: strndup(3): %s\n", __func__, strerror(errno));
+        node_free(ret);
+        return NULL;
+    }
+
+    return ret;
+}
+
+static struct node **find_child(const struct node *const n, const char c)
+{
+    for (size_t i = 0; i < n->n_children; i++)
+        if (*n->children[i]->label == c)
+            return &n->children[i];
+
+    return NULL;
+}
+
+static struct node *append_child(struct node *const n, const char *const key,
+    const size_t len, const size_t prio)
+{
+    const size_t nc = n->n_children + 1;
+    struct node **const children = realloc(n->children,
+        nc * sizeof *n->children);
+
+    if (!children)
+    {
+        fprintf(stderr, "%s: realloc(3): %s\n", __func__, strerror(errno));
+        return NULL;
+    }
+
+    n->children = children;
+
+    struct node *const ret = node_alloc(key, len, prio);
+
+    if (!ret)
+    {
+        fprintf(stderr, "%s: node_alloc failed\n", __func__);
+        return NULL;
+    }
+
+    children[n->n_children++] = ret;
+    return ret;
+}
+
+/* Splits *pc so that its label is exactly n characters long, and returns
+ * the new intermediate node. */
+static struct node *split(struct node **const pc, const size_t n)
+{
+    struct node *const c = *pc,
+        *const mid = node_alloc(c->label, n, c->min_prio);
+    char *label = NULL;
+
+    if (!mid)
+    {
+        fprintf(stderr, "%s: node_alloc failed\n", __func__);
+        goto failure;
+    }
+    else if (!(mid->children = malloc(sizeof *mid->children)))
+    {
+        fprintf(stderr, "%s: malloc(3): %s\n", __func__, strerror(errno));
+        goto failure;
+    }
+    else if (!(label = strdup(c->label + n)))
+    {
+        fprintf(stderr, "%s: strdup(3): %s\n", __func__, strerror(errno));
+        goto failure;
+    }
+
+    free(c->label);
+    c->label = label;
+    c->len -= n;
+    mid->children[mid->n_children++] = c;
+    *pc = mid;
+    return mid;
+
+failure:
+    node_free(mid);
+    return NULL;
+}
+
+static struct node *insert(struct node *n, const char *key, size_t len,
+    const size_t prio)
+{
+    while (len)
+    {
+        struct node **const pc = find_child(n, *key);
+
+        if (!pc)
+            return append_child(n, key, len, prio);
+
+        struct node *const c = *pc;
+        size_t common = 1;
+
+        while (common < c->len && common < len
+            && c->label[common] == key[common])
+            common++;
+
+        if (common < c->len)
+        {
+            if (!(n = split(pc, common)))
+            {
+                fprintf(stderr, "%s: split failed\n", __func__);
+                return NULL;
+            }
+        }
+        else
+            n = c;
+
+        key += common;
+        len -= common;
+    }
+
+    return n;
+}
+
+static struct node *insert_star(struct router *const r, struct node *const n)
+{
+    if (!n->star)
+    {
+        if (!(n->star = node_alloc("", 0, r->n)))
+        {
+            fprintf(stderr, "%s: node_alloc failed\n", __func__);
+            return NULL;
+        }
+
+        n->star->id = r->n_stars++;
+    }
+
+    return n->star;
+}
+
+int router_add(struct router *const r, const char *pattern, void *const user)
+{
+    struct node *n = r->root;
+
+    while (*pattern)
+    {
+        if (*pattern == '*')
+        {
+            /* Consecutive '*' are equivalent to a single one. */
+            pattern += strspn(pattern, "*");
+
+            if (!(n = insert_star(r, n)))
+            {
+                fprintf(stderr, "%s: insert_star failed\n", __func__);
+                return -1;
+            }
+        }
+        else
+        {
+            const size_t len = strcspn(pattern, "*");
+
+            if (!(n = insert(n, pattern, len, r->n)))
+            {
+                fprintf(stderr, "%s: insert failed\n", __func__);
+                return -1;
+            }
+
+            pattern += len;
+        }
+    }
+
+    /* Routes are tried in registration order, so a pattern that was
+     * already added always takes precedence. */
+    if (!n->route)
+    {
+        n->route = true;
+        n->prio = r->n;
+        n->user = user;
+    }
+
+    r->n++;
+    return 0;
+}
+
+static bool worse(const struct match *const m, const struct node *const n)
+{
+    return m->best && n->min_prio >= m->best->prio;
+}
+
+static void enter(struct match *m, const struct node *t, const char *s,
+    size_t len);
+
+/* Follows the literal characters from s, starting from n, and enters
+ * every star node found on the way. */
+static void walk(struct match *const m, const struct node *n, const char *s,
+    size_t len)
+{
+    for (;;)
+    {
+        if (worse(m, n))
+            return;
+        else if (!len && n->route && (!m->best || n->prio < m->best->prio))
+            m->best = n;
+
+        if (n->star)
+            enter(m, n->star, s, len);
+
+        if (!len)
+            return;
+
+        struct node *const *const pc = find_child(n, *s);
+
+        if (!pc)
+            return;
+
+        const struct node *const c = *pc;
+
+        if (c->len > len || memcmp(c->label, s, c->len))
+            return;
+
+        s += c->len;
+        len -= c->len;
+        n = c;
+    }
+}
+
+static void enter(struct match *const m, const struct node *const t,
+    const char *const s, const size_t len)
+{
+    if (t->id < MAX_STARS)
+    {
+        unsigned long *const w = &m->seen[t->id / BITS];
+        const unsigned long bit = 1ul << t->id % BITS;
+
+        if (*w & bit)
+            return;
+
+        *w |= bit;
+    }
+
+    for (size_t i = 0; i <= len && !worse(m, t); i++)
+        walk(m, t, s + i, len - i);
+}
+
+void *router_match(const struct router *const r, const char *const s)
+{
+    struct match m = {0};
+
+    walk(&m, r->root, s, strlen(s));
+    return m.best ? m.best->user : NULL;
+}
+
+void router_free(struct router *const r)
+{
+    if (r)
+        node_free(r->root);
+
+    free(r);
+}
+
+struct router *router_alloc(void)
+{
+    struct router *const r = malloc(sizeof *r);
+
+    if (!r)
+    {
+        fprintf(stderr, "%s: malloc(3): %s\n", __func__, strerror(errno));
+        return NULL;
+    }
+
+    *r = (const struct router){.root = node_alloc("", 0, 0)};
+
+    if (!r->root)
+    {
+        fprintf(stderr, "%s: node_alloc failed\n", __func__);
+        router_free(r);
+        return NULL;
+    }
+
+    return r;
+}
@@ -6,9 +6,26 @@
 #define _POSIX_C_SOURCE 200809L
 #endif
 
+/* glibc only exposes SO_REUSEPORT with _DEFAULT_SOURCE, and splice(2)
+ * with _GNU_SOURCE, which implies the former. */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#if defined(__linux__) && !defined(LIBWEB_USE_POLL)
+#define LIBWEB_USE_EPOLL
+#endif
+
 #include "libweb/server.h"
 #include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#ifdef LIBWEB_USE_EPOLL
+#include <sys/epoll.h>
+#endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #include <netinet/in.h>
 #include <poll.h>
 #include <unistd.h>
@@ -19,15 +36,52 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 struct server
 {
-    int fd;
+    int fd, wake[2];
+#ifdef __linux__
+    /* Used by server_splice. Allocated on first use. */
+    int splice[2];
+#endif
+
+#ifdef LIBWEB_USE_EPOLL
+    int epfd;
+    struct epoll_event events[64];
+#else
+    struct pollfd *fds;
+    struct server_client **pc;
+    size_t n_fds, rotate;
+#endif
+
+    /* Clients returned by the last call to server_poll_all. server_poll
+     * consumes them one by one, so one wakeup serves a whole batch. */
+    struct server_ready *ready;
+    size_t n_ready, i_ready, max_ready;
+
+    /* Closed clients are kept here, up to pool_max, so that accepting
+     * a connection does not need to call malloc(3). */
+    struct server_client *pool;
+    size_t n_pool, pool_max, max_accept;
+
+    /* Set while accept(2) cannot proceed because resources are exhausted.
+     * The listening socket is then not watched until a client is closed
+     * or until resume, so that pending connections do not wake up the
+     * server over and over. */
+    bool paused;
+    unsigned long long resume, next_log;
+    unsigned long n_exhausted;
 
     struct server_client
     {
         int fd;
         bool write;
+#ifdef LIBWEB_USE_EPOLL
+        int epfd;
+#endif
+        size_t ready;
+        void *user;
         struct server_client *prev, *next;
     } *c;
 };
@@ -41,46 +95,114 @@ int server_close(struct server *const s)
     else if (s->fd >= 0)
         ret = close(s->fd);
 
+    for (size_t i = 0; i < sizeof s->wake / sizeof *s->wake; i++)
+        if (s->wake[i] >= 0 && close(s->wake[i]))
+        {
+            fprintf(stderr, "%s: close(2) wake: %s\n",
+                __func__, strerror(errno));
+            ret = -1;
+        }
+
+#ifdef __linux__
+    for (size_t i = 0; i < sizeof s->splice / sizeof *s->splice; i++)
+        if (s->splice[i] >= 0 && close(s->splice[i]))
+        {
+            fprintf(stderr, "%s: close(2) splice: %s\n",
+                __func__, strerror(errno));
+            ret = -1;
+        }
+#endif
+
+#ifdef LIBWEB_USE_EPOLL
+    if (s->epfd >= 0 && close(s->epfd))
+    {
+        fprintf(stderr, "%s: close(2) epfd: %s\n", __func__, strerror(errno));
+        ret = -1;
+    }
+#else
+    free(s->fds);
+    free(s->pc);
+#endif
+
+    for (struct server_client *c = s->pool; c;)
+    {
+        struct server_client *const next = c->next;
+
+        free(c);
+        c = next;
+    }
+
+    free(s->ready);
     free(s);
     return ret;
 }
 
+static int watch_listener(struct server *s, bool watch);
+
 int server_client_close(struct server *const s, struct server_client *const c)
 {
     int ret = 0;
 
-    for (struct server_client *ref = s->c; ref; ref = ref->next)
-    {
-        if (c == ref)
-        {
-            struct server_client *const next = ref->next;
+    /* The pending batch from server_poll_all must not refer to c. */
+    if (c->ready < s->n_ready && s->ready[c->ready].c == c)
+        s->ready[c->ready].c = NULL;
 
-            if ((ret = close(c->fd)))
-            {
-                fprintf(stderr, "%s: close(2): %s\n",
-                    __func__, strerror(errno));
-            }
-            else if (ref->prev)
-                ref->prev->next = next;
-            else
-                s->c = next;
+#ifdef LIBWEB_USE_EPOLL
+    if (epoll_ctl(s->epfd, EPOLL_CTL_DEL, c->fd, NULL))
+        fprintf(stderr, "%s: epoll_ctl(2) EPOLL_CTL_DEL: %s\n",
+            __func__, strerror(errno));
+#endif
 
-            if (next)
-                next->prev = ref->prev;
+    if ((ret = close(c->fd)))
+        fprintf(stderr, "%s: close(2): %s\n", __func__, strerror(errno));
 
-            free(ref);
-            break;
-        }
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        s->c = c->next;
+
+    if (c->next)
+        c->next->prev = c->prev;
+
+    if (s->n_pool < s->pool_max)
+    {
+        c->next = s->pool;
+        s->pool = c;
+        s->n_pool++;
     }
+    else
+        free(c);
+
+    /* The closed connection might have freed the resources needed to
+     * accept another one. */
+    if (s->paused && watch_listener(s, true))
+        ret = -1;
 
     return ret;
 }
 
+void server_client_set_user(struct server_client *const c, void *const user)
+{
+    c->user = user;
+}
+
+void *server_client_get_user(const struct server_client *const c)
+{
+    return c->user;
+}
+
+/* Non-blocking sockets are expected to run out of data or buffer space
+ * every now and then, so callers are left to handle such errors. */
+static bool would_block(void)
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
 int server_read(void *const buf, const size_t n, struct server_client *const c)
 {
     const ssize_t r = read(c->fd, buf, n);
 
-    if (r < 0)
+    if (r < 0 && !would_block())
         fprintf(stderr, "%s: read(2): %s\n", __func__, strerror(errno));
 
     return r;
@@ -91,46 +213,317 @@ int server_write(const void *const buf, const size_t n,
 {
     const ssize_t w = write(c->fd, buf, n);
 
-    if (w < 0)
+    if (w < 0 && !would_block())
         fprintf(stderr, "%s: write(2): %s\n", __func__, strerror(errno));
 
     return w;
 }
 
-static struct server_client *alloc_client(struct server *const s)
+int server_writev(const struct iovec *const iov, const int n,
+    struct server_client *const c)
+{
+    const ssize_t w = writev(c->fd, iov, n);
+
+    if (w < 0 && !would_block())
+        fprintf(stderr, "%s: writev(2): %s\n", __func__, strerror(errno));
+
+    return w;
+}
+
+int server_sendfile(const int fd, const off_t offset, const size_t n,
+    struct server_client *const c)
+{
+#ifdef __linux__
+    off_t off = offset;
+    const ssize_t w = sendfile(c->fd, fd, &off, n);
+
+    if (w < 0 && !would_block())
+        fprintf(stderr, "%s: sendfile(2): %s\n", __func__, strerror(errno));
+
+    return w;
+#else
+    char buf[BUFSIZ];
+    const ssize_t r = pread(fd, buf, n > sizeof buf ? sizeof buf : n, offset);
+
+    if (r <= 0)
+    {
+        if (r < 0)
+            fprintf(stderr, "%s: pread(2): %s\n", __func__, strerror(errno));
+
+        return r;
+    }
+
+    return server_write(buf, r, c);
+#endif
+}
+
+#ifdef __linux__
+static void close_splice(struct server *const s)
+{
+    for (size_t i = 0; i < sizeof s->splice / sizeof *s->splice; i++)
+    {
+        if (close(s->splice[i]))
+            fprintf(stderr, "%s: close(2): %s\n", __func__, strerror(errno));
+
+        s->splice[i] = -1;
+    }
+}
+#endif
+
+int server_splice(const int fd, const off_t offset, const size_t n,
+    struct server *const s, struct server_client *const c)
+{
+#ifdef __linux__
+    /* Data is moved from the socket into a pipe, and then from the pipe
+     * into fd, so that it is never copied through user space. The pipe
+     * is always drained before returning, so that it can be shared by
+     * all clients. */
+    enum {MAX = 65536};
+
+    if (s->splice[0] < 0 && pipe(s->splice))
+    {
+        fprintf(stderr, "%s: pipe(2): %s\n", __func__, strerror(errno));
+        return -1;
+    }
+
+    ssize_t total = 0;
+    loff_t off = offset;
+
+    /* Keep going until n bytes are moved or the socket runs out of data,
+     * so that callers can tell the latter from a short return value. */
+    while ((size_t)total < n)
+    {
+        const size_t rem = n - total, max = rem > MAX ? MAX : rem;
+        const ssize_t r = splice(c->fd, NULL, s->splice[1], NULL, max,
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (r <= 0)
+        {
+            /* Any error is reported again by the next call. */
+            if (total)
+                break;
+            else if (r < 0 && !would_block())
+                fprintf(stderr, "%s: splice(2) socket: %s\n",
+                    __func__, strerror(errno));
+
+            return r;
+        }
+
+        for (ssize_t left = r; left;)
+        {
+            const ssize_t w = splice(s->splice[0], NULL, fd, &off, left,
+                SPLICE_F_MOVE);
+
+            if (w <= 0)
+            {
+                fprintf(stderr, "%s: splice(2) file: %s\n", __func__,
+                    w ? strerror(errno) : "unexpected end of pipe");
+                /* Discard any remaining data from the pipe. */
+                close_splice(s);
+                return -1;
+            }
+
+            left -= w;
+        }
+
+        total += r;
+
+        if ((size_t)r < max)
+            break;
+    }
+
+    return total;
+#else
+    char buf[BUFSIZ];
+    const ssize_t r = read(c->fd, buf, n > sizeof buf ? sizeof buf : n);
+
+    if (r <= 0)
+    {
+        if (r < 0 && !would_block())
+            fprintf(stderr, "%s: read(2): %s\n", __func__, strerror(errno));
+
+        return r;
+    }
+
+    for (ssize_t written = 0; written < r;)
+    {
+        const ssize_t w = pwrite(fd, buf + written, r - written,
+            offset + written);
+
+        if (w < 0)
+        {
+            fprintf(stderr, "%s: pwrite(2): %s\n", __func__, strerror(errno));
+            return -1;
+        }
+
+        written += w;
+    }
+
+    return r;
+#endif
+}
+
+/* Running out of file descriptors or memory is expected under heavy
+ * load, and must only stop accepting connections until some are closed,
+ * instead of stopping the server. */
+static bool exhausted(const int error)
+{
+    switch (error)
+    {
+        case EMFILE:
+        case ENFILE:
+        case ENOBUFS:
+        case ENOMEM:
+#ifdef LIBWEB_USE_EPOLL
+        case ENOSPC:
+#endif
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+static int get_time(unsigned long long *const now)
 {
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    {
+        fprintf(stderr, "%s: clock_gettime(2): %s\n",
+            __func__, strerror(errno));
+        return -1;
+    }
+
+    *now = ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+    return 0;
+}
+
+static int watch_listener(struct server *const s, const bool watch)
+{
+#ifdef LIBWEB_USE_EPOLL
+    struct epoll_event ev =
+    {
+        .events = watch ? EPOLLIN : 0,
+        .data.ptr = s
+    };
+
+    if (epoll_ctl(s->epfd, EPOLL_CTL_MOD, s->fd, &ev))
+    {
+        fprintf(stderr, "%s: epoll_ctl(2) EPOLL_CTL_MOD: %s\n",
+            __func__, strerror(errno));
+        return -1;
+    }
+#endif
+
+    s->paused = !watch;
+    return 0;
+}
+
+/* Stops accepting connections for ACCEPT_RETRY milliseconds, or until a
+ * client is closed. Errors are only reported once every ACCEPT_LOG
+ * milliseconds, since a busy server might run into them very often. */
+static int pause_accept(struct server *const s, const char *const op,
+    const int error)
+{
+    enum {ACCEPT_RETRY = 100, ACCEPT_LOG = 1000};
+    unsigned long long now;
+
+    if (get_time(&now))
+    {
+        fprintf(stderr, "%s: get_time failed\n", __func__);
+        return -1;
+    }
+    else if (now >= s->next_log)
+    {
+        fprintf(stderr, "%s: %s: %s, pausing (%lu more since last report)\n",
+            __func__, op, strerror(error), s->n_exhausted);
+        s->next_log = now + ACCEPT_LOG;
+        s->n_exhausted = 0;
+    }
+    else
+        s->n_exhausted++;
+
+    s->resume = now + ACCEPT_RETRY;
+    return watch_listener(s, false);
+}
+
+/* Returns zero and sets *out to a null pointer if no connections are
+ * pending, or if resources are exhausted. */
+static int alloc_client(struct server *const s,
+    struct server_client **const out)
+{
+    int error;
     struct sockaddr_in addr;
     socklen_t sz = sizeof addr;
+#if defined(__linux__) || defined(__FreeBSD__)
+    const int fd = accept4(s->fd, (struct sockaddr *)&addr, &sz,
+        SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
     const int fd = accept(s->fd, (struct sockaddr *)&addr, &sz);
+#endif
+
+    *out = NULL;
 
     if (fd < 0)
     {
-        fprintf(stderr, "%s: accept(2): %s\n",
-            __func__, strerror(errno));
-        return NULL;
+        switch (errno)
+        {
+            case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+            case EWOULDBLOCK:
+#endif
+            case EINTR:
+            case ECONNABORTED:
+                return 0;
+
+            default:
+                if (exhausted(errno))
+                    return pause_accept(s, "accept(2)", errno);
+
+                fprintf(stderr, "%s: accept(2): %s\n",
+                    __func__, strerror(errno));
+                return -1;
+        }
     }
 
+#if !defined(__linux__) && !defined(__FreeBSD__)
     const int flags = fcntl(fd, F_GETFL);
 
     if (flags < 0)
     {
+        error = errno;
         fprintf(stderr, "%s: fcntl(2) F_GETFL: %s\n",
             __func__, strerror(errno));
-        return NULL;
+        goto failure;
     }
     else if (fcntl(fd, F_SETFL, flags | O_NONBLOCK))
     {
+        error = errno;
         fprintf(stderr, "%s: fcntl(2) F_SETFL: %s\n",
             __func__, strerror(errno));
-        return NULL;
+        goto failure;
     }
+    else if (fcntl(fd, F_SETFD, FD_CLOEXEC))
+    {
+        error = errno;
+        fprintf(stderr, "%s: fcntl(2) F_SETFD: %s\n",
+            __func__, strerror(errno));
+        goto failure;
+    }
+#endif
 
-    struct server_client *const c = malloc(sizeof *c);
+    struct server_client *c = s->pool;
 
-    if (!c)
+    if (c)
     {
-        fprintf(stderr, "%s: malloc(3): %s\n", __func__, strerror(errno));
-        return NULL;
+        s->pool = c->next;
+        s->n_pool--;
+    }
+    else if (!(c = malloc(sizeof *c)))
+    {
+        error = errno;
+        goto failure;
     }
 
     *c = (const struct server_client)
@@ -138,23 +531,64 @@ static struct server_client *alloc_client(struct server *const s)
         .fd = fd
     };
 
-    if (!s->c)
-        s->c = c;
-    else
-        for (struct server_client *ref = s->c; ref; ref = ref->next)
-            if (!ref->next)
-            {
-                ref->next = c;
-                c->prev = ref;
-                break;
-            }
+#ifdef LIBWEB_USE_EPOLL
+    struct epoll_event ev =
+    {
+        .events = EPOLLIN,
+        .data.ptr = c
+    };
+
+    c->epfd = s->epfd;
+
+    if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev))
+    {
+        error = errno;
+        free(c);
+
+        if (!exhausted(error))
+            fprintf(stderr, "%s: epoll_ctl(2) EPOLL_CTL_ADD: %s\n",
+                __func__, strerror(error));
+
+        goto failure;
+    }
+#endif
+
+    if (s->c)
+        s->c->prev = c;
+
+    c->next = s->c;
+    s->c = c;
+    *out = c;
+    return 0;
 
-    return c;
+failure:
+    if (close(fd))
+        fprintf(stderr, "%s: close(2): %s\n", __func__, strerror(errno));
+
+    return exhausted(error) ? pause_accept(s, "set up client", error) : -1;
 }
 
 void server_client_write_pending(struct server_client *const c,
     const bool write)
 {
+#ifdef LIBWEB_USE_EPOLL
+    if (c->write == write)
+        return;
+
+    struct epoll_event ev =
+    {
+        .events = write ? EPOLLIN | EPOLLOUT : EPOLLIN,
+        .data.ptr = c
+    };
+
+    if (epoll_ctl(c->epfd, EPOLL_CTL_MOD, c->fd, &ev))
+    {
+        fprintf(stderr, "%s: epoll_ctl(2) EPOLL_CTL_MOD: %s\n",
+            __func__, strerror(errno));
+        return;
+    }
+#endif
+
     c->write = write;
 }
 
@@ -175,67 +609,231 @@ static void handle_signal(const int signum)
     }
 }
 
-static size_t get_clients(const struct server *const s)
+static int append_ready(struct server *const s,
+    struct server_client *const c, const bool io)
 {
-    size_t ret = 0;
+    if (s->n_ready >= s->max_ready)
+    {
+        const size_t n = s->max_ready * 2;
+        struct server_ready *const ready = realloc(s->ready,
+            n * sizeof *ready);
 
-    for (const struct server_client *c = s->c; c; c = c->next)
-        ret++;
+        if (!ready)
+        {
+            fprintf(stderr, "%s: realloc(3): %s\n", __func__, strerror(errno));
+            return -1;
+        }
 
-    return ret;
+        s->ready = ready;
+        s->max_ready = n;
+    }
+
+    c->ready = s->n_ready;
+    s->ready[s->n_ready++] = (const struct server_ready)
+    {
+        .c = c,
+        .io = io
+    };
+
+    return 0;
 }
 
-struct server_client *server_poll(struct server *const s, bool *const io,
+/* Watches the listening socket again once accept(2) has been paused for
+ * long enough. Otherwise, *timeout is shortened so that the wait ends by
+ * then, since resources might also be released by other processes. */
+static int check_paused(struct server *const s, int *const timeout)
+{
+    unsigned long long now;
+
+    if (!s->paused)
+        return 0;
+    else if (get_time(&now))
+    {
+        fprintf(stderr, "%s: get_time failed\n", __func__);
+        return -1;
+    }
+    else if (now >= s->resume)
+        return watch_listener(s, true);
+    else if (*timeout < 0 || (unsigned long long)*timeout > s->resume - now)
+        *timeout = s->resume - now;
+
+    return 0;
+}
+
+/* Accepts up to max_accept pending connections at once, so that
+ * connection storms do not need one wakeup per connection. */
+static int accept_clients(struct server *const s)
+{
+    for (size_t i = 0; i < s->max_accept; i++)
+    {
+        struct server_client *c;
+
+        if (alloc_client(s, &c))
+        {
+            fprintf(stderr, "%s: alloc_client failed\n", __func__);
+            return -1;
+        }
+        else if (!c)
+            break;
+        else if (append_ready(s, c, false))
+            return -1;
+    }
+
+    return 0;
+}
+
+#ifdef LIBWEB_USE_EPOLL
+static int wait_events(struct server *const s, int timeout,
     bool *const exit)
 {
-    struct server_client *ret = NULL;
-    const size_t n_clients = get_clients(s);
-    const nfds_t n = n_clients + 1;
-    struct pollfd *const fds = malloc(n * sizeof *fds);
+    int res;
+
+    if (check_paused(s, &timeout))
+        return -1;
 
-    if (!fds)
+again:
+
+    res = epoll_wait(s->epfd, s->events,
+        sizeof s->events / sizeof *s->events, timeout);
+
+    if (res < 0)
     {
-        fprintf(stderr, "%s: malloc(3): %s\n", __func__, strerror(errno));
-        goto end;
+        if (do_exit)
+        {
+            *exit = true;
+            return 0;
+        }
+
+        switch (errno)
+        {
+            case EAGAIN:
+                /* Fall through. */
+            case EINTR:
+                goto again;
+
+            default:
+                fprintf(stderr, "%s: epoll_wait(2): %s\n",
+                    __func__, strerror(errno));
+                break;
+        }
+
+        return -1;
     }
 
-    struct pollfd *const sfd = &fds[0];
+    /* epoll(7) already moves ready file descriptors to the tail of its
+     * ready list, so clients are returned in a fair order. */
+    for (int i = 0; i < res; i++)
+    {
+        void *const ptr = s->events[i].data.ptr;
 
-    *io = *exit = false;
-    *sfd = (const struct pollfd)
+        if (ptr == s->wake)
+        {
+            *exit = true;
+            return 0;
+        }
+        else if (ptr == s)
+        {
+            if (accept_clients(s))
+                return -1;
+        }
+        else if (append_ready(s, ptr, true))
+            return -1;
+    }
+
+    return 0;
+}
+#else
+enum {LISTEN_FD, WAKE_FD, FIRST_CLIENT};
+
+static int prepare_fds(struct server *const s, size_t *const n)
+{
+    size_t n_clients = 0;
+
+    for (const struct server_client *c = s->c; c; c = c->next)
+        n_clients++;
+
+    if (n_clients + FIRST_CLIENT > s->n_fds)
+    {
+        const size_t nfds = n_clients + FIRST_CLIENT;
+        struct pollfd *const fds = realloc(s->fds, nfds * sizeof *fds);
+
+        if (!fds)
+        {
+            fprintf(stderr, "%s: realloc(3) fds: %s\n",
+                __func__, strerror(errno));
+            return -1;
+        }
+
+        s->fds = fds;
+
+        struct server_client **const pc = realloc(s->pc, nfds * sizeof *pc);
+
+        if (!pc)
+        {
+            fprintf(stderr, "%s: realloc(3) pc: %s\n",
+                __func__, strerror(errno));
+            return -1;
+        }
+
+        s->pc = pc;
+        s->n_fds = nfds;
+    }
+
+    /* poll(2) ignores negative file descriptors. */
+    s->fds[LISTEN_FD] = (const struct pollfd)
+    {
+        .fd = s->paused ? -1 : s->fd,
+        .events = POLLIN
+    };
+
+    s->fds[WAKE_FD] = (const struct pollfd)
     {
-        .fd = s->fd,
+        .fd = s->wake[0],
         .events = POLLIN
     };
 
-    for (struct {const struct server_client *c; size_t j;}
-        _ = {.c = s->c, .j = 1}; _.c; _.c = _.c->next, _.j++)
+    size_t j = FIRST_CLIENT;
+
+    for (struct server_client *c = s->c; c; c = c->next, j++)
     {
-        struct pollfd *const p = &fds[_.j];
-        const int fd = _.c->fd;
+        struct pollfd *const p = &s->fds[j];
 
         *p = (const struct pollfd)
         {
-            .fd = fd,
+            .fd = c->fd,
             .events = POLLIN
         };
 
-        if (_.c->write)
+        if (c->write)
             p->events |= POLLOUT;
+
+        s->pc[j] = c;
     }
 
+    *n = j;
+    return 0;
+}
+
+static int wait_events(struct server *const s, int timeout,
+    bool *const exit)
+{
+    size_t n;
+
+    if (check_paused(s, &timeout) || prepare_fds(s, &n))
+        return -1;
+
     int res;
 
 again:
 
-    res = poll(fds, n, -1);
+    res = poll(s->fds, n, timeout);
 
     if (res < 0)
     {
         if (do_exit)
         {
             *exit = true;
-            goto end;
+            return 0;
         }
 
         switch (errno)
@@ -250,37 +848,134 @@ again:
                 break;
         }
 
-        goto end;
+        return -1;
     }
     else if (!res)
+        return 0;
+    else if (s->fds[WAKE_FD].revents)
     {
-        fprintf(stderr, "%s: poll(2) returned zero\n", __func__);
-        goto end;
+        *exit = true;
+        return 0;
     }
-    else if (sfd->revents)
+
+    const size_t n_clients = n - FIRST_CLIENT;
+
+    if (n_clients)
     {
-        ret = alloc_client(s);
-        goto end;
+        /* Start from a different client on every call, so clients at the
+         * front of the list are not always served first. */
+        const size_t start = s->rotate++ % n_clients;
+
+        for (size_t i = 0; i < n_clients; i++)
+        {
+            const size_t j = FIRST_CLIENT + (start + i) % n_clients;
+
+            if (s->fds[j].revents && append_ready(s, s->pc[j], true))
+                return -1;
+        }
     }
 
-    for (struct {struct server_client *c; size_t j;}
-        _ = {.c = s->c, .j = 1}; _.c; _.c = _.c->next, _.j++)
+    if (s->fds[LISTEN_FD].revents && accept_clients(s))
+        return -1;
+
+    return 0;
+}
+#endif
+
+const struct server_ready *server_poll_all(struct server *const s,
+    size_t *const n, const int timeout, bool *const exit)
+{
+    *exit = false;
+    s->n_ready = s->i_ready = 0;
+
+    if (wait_events(s, timeout, exit) || *exit)
+        return NULL;
+
+    *n = s->n_ready;
+    return s->ready;
+}
+
+struct server_client *server_poll(struct server *const s, bool *const io,
+    bool *const exit)
+{
+    *io = *exit = false;
+
+    for (;;)
     {
-        const struct pollfd *const p = &fds[_.j];
+        if (s->i_ready >= s->n_ready)
+        {
+            size_t n;
 
-        if (p->revents)
+            if (!server_poll_all(s, &n, -1, exit))
+                return NULL;
+        }
+
+        const struct server_ready *const r = &s->ready[s->i_ready++];
+
+        if (r->c)
         {
-            *io = true;
-            ret = _.c;
-            goto end;
+            *io = r->io;
+            return r->c;
         }
+
+        /* Otherwise, the client was closed after it was returned. */
     }
+}
 
-    fprintf(stderr, "%s: unlisted fd\n", __func__);
+int server_wake(struct server *const s)
+{
+    const char b = 0;
 
-end:
-    free(fds);
-    return ret;
+    if (write(s->wake[1], &b, sizeof b) < 0 && errno != EAGAIN)
+    {
+        fprintf(stderr, "%s: write(2): %s\n", __func__, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int init_wake(struct server *const s)
+{
+    if (pipe(s->wake))
+    {
+        fprintf(stderr, "%s: pipe(2): %s\n", __func__, strerror(errno));
+        return -1;
+    }
+
+    for (size_t i = 0; i < sizeof s->wake / sizeof *s->wake; i++)
+    {
+        const int fd = s->wake[i], flags = fcntl(fd, F_GETFL);
+
+        if (flags < 0)
+        {
+            fprintf(stderr, "%s: fcntl(2) F_GETFL: %s\n",
+                __func__, strerror(errno));
+            return -1;
+        }
+        else if (fcntl(fd, F_SETFL, flags | O_NONBLOCK))
+        {
+            fprintf(stderr, "%s: fcntl(2) F_SETFL: %s\n",
+                __func__, strerror(errno));
+            return -1;
+        }
+    }
+
+#ifdef LIBWEB_USE_EPOLL
+    struct epoll_event ev =
+    {
+        .events = EPOLLIN,
+        .data.ptr = s->wake
+    };
+
+    if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->wake[0], &ev))
+    {
+        fprintf(stderr, "%s: epoll_ctl(2): %s\n", __func__, strerror(errno));
+        return -1;
+    }
+#endif
+
+    return 0;
 }
 
 static int init_signals(void)
@@ -319,7 +1014,27 @@ static int init_signals(void)
     return 0;
 }
 
-struct server *server_init(const unsigned short port,
+static int warm_pool(struct server *const s, const size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        struct server_client *const c = malloc(sizeof *c);
+
+        if (!c)
+        {
+            fprintf(stderr, "%s: malloc(3): %s\n", __func__, strerror(errno));
+            return -1;
+        }
+
+        c->next = s->pool;
+        s->pool = c;
+        s->n_pool++;
+    }
+
+    return 0;
+}
+
+struct server *server_init(const struct server_cfg *const cfg,
     unsigned short *const outport)
 {
     struct server *const s = malloc(sizeof *s);
@@ -330,9 +1045,22 @@ struct server *server_init(const unsigned short port,
         goto failure;
     }
 
+    enum {MIN_READY = 16, MAX_ACCEPT = 64};
+
     *s = (const struct server)
     {
-        .fd = socket(AF_INET, SOCK_STREAM, 0)
+        .fd = socket(AF_INET, SOCK_STREAM, 0),
+        .wake = {-1, -1},
+        .ready = malloc(MIN_READY * sizeof *s->ready),
+        .max_ready = MIN_READY,
+        .pool_max = cfg->pool_max,
+        .max_accept = cfg->max_accept ? cfg->max_accept : MAX_ACCEPT,
+#ifdef __linux__
+        .splice = {-1, -1},
+#endif
+#ifdef LIBWEB_USE_EPOLL
+        .epfd = epoll_create1(EPOLL_CLOEXEC)
+#endif
     };
 
     if (s->fd < 0)
@@ -340,26 +1068,78 @@ struct server *server_init(const unsigned short port,
         fprintf(stderr, "%s: socket(2): %s\n", __func__, strerror(errno));
         goto failure;
     }
+    else if (!s->ready)
+    {
+        fprintf(stderr, "%s: malloc(3): %s\n", __func__, strerror(errno));
+        goto failure;
+    }
+    else if (warm_pool(s, cfg->pool_warm))
+    {
+        fprintf(stderr, "%s: warm_pool failed\n", __func__);
+        goto failure;
+    }
+#ifdef LIBWEB_USE_EPOLL
+    else if (s->epfd < 0)
+    {
+        fprintf(stderr, "%s: epoll_create1(2): %s\n",
+            __func__, strerror(errno));
+        goto failure;
+    }
+#endif
     else if (init_signals())
     {
         fprintf(stderr, "%s: init_signals failed\n", __func__);
         goto failure;
     }
+    else if (init_wake(s))
+    {
+        fprintf(stderr, "%s: init_wake failed\n", __func__);
+        goto failure;
+    }
+    else if (cfg->reuseport)
+    {
+#ifdef SO_REUSEPORT
+        const int on = 1;
+
+        if (setsockopt(s->fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on))
+        {
+            fprintf(stderr, "%s: setsockopt(2) SO_REUSEPORT: %s\n",
+                __func__, strerror(errno));
+            goto failure;
+        }
+#else
+        fprintf(stderr, "%s: SO_REUSEPORT not supported\n", __func__);
+        goto failure;
+#endif
+    }
 
     const struct sockaddr_in addr =
     {
         .sin_family = AF_INET,
-        .sin_port = htons(port)
+        .sin_port = htons(cfg->port)
     };
 
-    enum {QUEUE_LEN = 10};
+    const int flags = fcntl(s->fd, F_GETFL);
 
     if (bind(s->fd, (const struct sockaddr *)&addr, sizeof addr))
     {
         fprintf(stderr, "%s: bind(2): %s\n", __func__, strerror(errno));
         goto failure;
     }
-    else if (listen(s->fd, QUEUE_LEN))
+    /* accept_clients relies on EAGAIN to know when to stop. */
+    else if (flags < 0)
+    {
+        fprintf(stderr, "%s: fcntl(2) F_GETFL: %s\n",
+            __func__, strerror(errno));
+        goto failure;
+    }
+    else if (fcntl(s->fd, F_SETFL, flags | O_NONBLOCK))
+    {
+        fprintf(stderr, "%s: fcntl(2) F_SETFL: %s\n",
+            __func__, strerror(errno));
+        goto failure;
+    }
+    else if (listen(s->fd, cfg->backlog > 0 ? cfg->backlog : SOMAXCONN))
     {
         fprintf(stderr, "%s: listen(2): %s\n", __func__, strerror(errno));
         goto failure;
@@ -376,6 +1156,20 @@ struct server *server_init(const unsigned short port,
     else if (outport)
         *outport = ntohs(in.sin_port);
 
+#ifdef LIBWEB_USE_EPOLL
+    struct epoll_event ev =
+    {
+        .events = EPOLLIN,
+        .data.ptr = s
+    };
+
+    if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->fd, &ev))
+    {
+        fprintf(stderr, "%s: epoll_ctl(2): %s\n", __func__, strerror(errno));
+        goto failure;
+    }
+#endif
+
     return s;
 
 failure:
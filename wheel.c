@@ -0,0 +1,155 @@
+#include "libweb/wheel.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Hashed timer wheel: timers are stored into the slot given by their
+ * expiry tick modulo WHEEL_SLOTS, so that adding, removing and expiring
+ * a timer are O(1). Timers further than WHEEL_SLOTS ticks away share
+ * slots with earlier ones, and are simply skipped until their round
+ * comes. All times are expressed in milliseconds. */
+enum {WHEEL_SLOTS = 512, WHEEL_TICK = 100};
+
+struct wheel
+{
+    unsigned long long tick;
+    size_t n;
+    struct wheel_timer *slots[WHEEL_SLOTS];
+};
+
+void wheel_remove(struct wheel *const w, struct wheel_timer *const t)
+{
+    if (!t->armed)
+        return;
+
+    struct wheel_timer **const slot = &w->slots[t->expiry % WHEEL_SLOTS];
+
+    if (t->prev)
+        t->prev->next = t->next;
+    else
+        *slot = t->next;
+
+    if (t->next)
+        t->next->prev = t->prev;
+
+    t->prev = t->next = NULL;
+    t->armed = false;
+    w->n--;
+}
+
+void wheel_add(struct wheel *const w, struct wheel_timer *const t,
+    const unsigned long long expiry)
+{
+    /* Round up, so that timers never expire early. */
+    unsigned long long tick = (expiry + WHEEL_TICK - 1) / WHEEL_TICK;
+
+    wheel_remove(w, t);
+
+    if (tick <= w->tick)
+        tick = w->tick + 1;
+
+    struct wheel_timer **const slot = &w->slots[tick % WHEEL_SLOTS];
+
+    t->expiry = tick;
+    t->armed = true;
+    t->prev = NULL;
+    t->next = *slot;
+
+    if (*slot)
+        (*slot)->prev = t;
+
+    *slot = t;
+    w->n++;
+}
+
+struct wheel_timer *wheel_expire(struct wheel *const w,
+    const unsigned long long now)
+{
+    const unsigned long long tick = now / WHEEL_TICK;
+    struct wheel_timer *ret = NULL;
+
+    if (tick <= w->tick)
+        return NULL;
+
+    /* Every slot is visited at most once, no matter how long it has
+     * been since the last call. */
+    const unsigned long long steps = tick - w->tick < WHEEL_SLOTS ?
+        tick - w->tick : WHEEL_SLOTS;
+
+    for (unsigned long long i = 1; i <= steps; i++)
+        for (struct wheel_timer *t = w->slots[(w->tick + i) % WHEEL_SLOTS];
+            t;)
+        {
+            struct wheel_timer *const next = t->next;
+
+            if (t->expiry <= tick)
+            {
+                wheel_remove(w, t);
+                t->next = ret;
+                ret = t;
+            }
+
+            t = next;
+        }
+
+    w->tick = tick;
+    return ret;
+}
+
+int wheel_timeout(const struct wheel *const w, const unsigned long long now)
+{
+    if (!w->n)
+        return -1;
+
+    /* Slots are shared with timers from later rounds, so the first
+     * non-empty slot does not necessarily hold the earliest timer. Since
+     * every timer expires after w->tick, any timer found for the current
+     * round is the earliest one. Otherwise, the earliest timer from later
+     * rounds is used. */
+    unsigned long long min = ULLONG_MAX;
+
+    for (unsigned long long i = 1; i <= WHEEL_SLOTS; i++)
+    {
+        const unsigned long long tick = w->tick + i;
+
+        for (const struct wheel_timer *t = w->slots[tick % WHEEL_SLOTS]; t;
+            t = t->next)
+            if (t->expiry < min)
+                min = t->expiry;
+
+        if (min <= tick)
+            break;
+    }
+
+    const unsigned long long t = min * WHEEL_TICK;
+
+    if (t <= now)
+        return 0;
+    else if (t - now > INT_MAX)
+        return INT_MAX;
+
+    return t - now;
+}
+
+void wheel_free(struct wheel *const w)
+{
+    free(w);
+}
+
+struct wheel *wheel_alloc(const unsigned long long now)
+{
+    struct wheel *const w = malloc(sizeof *w);
+
+    if (!w)
+    {
+        fprintf(stderr, "%s: malloc(3): %s\n", __func__, strerror(errno));
+        return NULL;
+    }
+
+    *w = (const struct wheel){.tick = now / WHEEL_TICK};
+    return w;
+}
@@ -1,73 +1,236 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "libweb/wildcard_cmp.h"
+#include <errno.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 
-int wildcard_cmp(const char *s, const char *p, const bool casecmp)
+/* A compiled pattern is split by its '*' metacharacters into a literal
+ * prefix, a literal suffix and the non-empty literal segments between
+ * them. Since '*' matches any number of characters, the leftmost
+ * occurrence of each segment is always the best choice, so no
+ * backtracking is ever needed. */
+struct wildcard
 {
-    const char *last = NULL;
-    int (*const cmp)(const char *, const char *) =
-        casecmp ? strcmp : strcasecmp;
-    int (*const ncmp)(const char *, const char *, size_t) =
-        casecmp ? strncmp : strncasecmp;
+    char *p;
+    bool casecmp, star;
+    size_t n_segments;
 
-    while (*p && *s)
+    struct segment
     {
-        const char *const wc = strchr(p, '*');
+        const char *p;
+        size_t n;
+    } prefix, suffix, *segments;
+};
+
+static int cmp(const struct wildcard *const w, const char *const a,
+    const char *const b, const size_t n)
+{
+    return w->casecmp ? memcmp(a, b, n) : strncasecmp(a, b, n);
+}
 
-        if (!wc)
+static const char *find(const struct wildcard *const w, const char *s,
+    size_t n, const struct segment *const seg)
+{
+    while (n >= seg->n)
+    {
+        if (w->casecmp)
         {
-            const int r = cmp(s, p);
-
-            if (r && last)
-            {
-                p = last;
-                s += strlen(p);
-                continue;
-            }
-            else
-                return r;
+            const char *const c = memchr(s, *seg->p, n - seg->n + 1);
+
+            if (!c)
+                return NULL;
+
+            n -= c - s;
+            s = c;
         }
 
-        const size_t auxn = wc - p, rem = strlen(s),
-            n = auxn > rem ? rem : auxn;
+        if (!cmp(w, s, seg->p, seg->n))
+            return s;
+
+        s++;
+        n--;
+    }
+
+    return NULL;
+}
+
+/* Checks the literal prefix and suffix against both ends of s, so that
+ * only the characters between them are searched for the remaining
+ * segments. */
+static int match_ends(const struct wildcard *const w, const char *const s,
+    const size_t n)
+{
+    const struct segment *const pre = &w->prefix, *const suf = &w->suffix;
+
+    if (!w->star)
+        return n != pre->n ? -1 : cmp(w, s, pre->p, pre->n);
+    else if (n < pre->n + suf->n
+        || cmp(w, s, pre->p, pre->n)
+        || cmp(w, s + n - suf->n, suf->p, suf->n))
+        return -1;
+
+    return 0;
+}
+
+int wildcard_match(const struct wildcard *const w, const char *const s,
+    const size_t n)
+{
+    const int ret = match_ends(w, s, n);
+
+    if (ret || !w->star)
+        return ret;
+
+    const char *cur = s + w->prefix.n;
+    const char *const end = s + n - w->suffix.n;
+
+    for (size_t i = 0; i < w->n_segments; i++)
+    {
+        const struct segment *const seg = &w->segments[i];
+
+        if (!(cur = find(w, cur, end - cur, seg)))
+            return -1;
+
+        cur += seg->n;
+    }
+
+    return 0;
+}
+
+/* Segments are split from p as they are needed, instead of being stored
+ * by wildcard_compile, so that no allocations are required. Otherwise,
+ * p is matched exactly as wildcard_match does. */
+int wildcard_cmp(const char *const s, const char *const p, const bool casecmp)
+{
+    const char *const first = strchr(p, '*');
+    const size_t n = strlen(s);
+    struct wildcard w = {.casecmp = casecmp};
+
+    if (!first)
+        w.prefix = (const struct segment){.p = p, .n = strlen(p)};
+    else
+    {
+        const char *const last = strrchr(p, '*') + 1;
+
+        w.star = true;
+        w.prefix = (const struct segment){.p = p, .n = first - p};
+        w.suffix = (const struct segment){.p = last, .n = strlen(last)};
+    }
+
+    const int ret = match_ends(&w, s, n);
+
+    if (ret || !w.star)
+        return ret;
+
+    const char *cur = s + w.prefix.n;
+    const char *const end = s + n - w.suffix.n;
+
+    for (const char *q = first + 1; q < w.suffix.p;)
+    {
+        const char *const wc = strchr(q, '*');
+        const struct segment seg = {.p = q, .n = wc - q};
 
-        if (n)
+        if (seg.n)
         {
-            const int r = ncmp(s, p, n);
-
-            if (r)
-            {
-                if (last)
-                    p = last;
-                else
-                    return r;
-            }
-            else
-                p += n;
-
-            s += n;
+            if (!(cur = find(&w, cur, end - cur, &seg)))
+                return -1;
+
+            cur += seg.n;
         }
-        else
+
+        q = wc + 1;
+    }
+
+    return 0;
+}
+
+void wildcard_free(struct wildcard *const w)
+{
+    if (w)
+    {
+        free(w->segments);
+        free(w->p);
+    }
+
+    free(w);
+}
+
+static int append_segment(struct wildcard *const w, const char *const p,
+    const size_t n)
+{
+    const size_t ns = w->n_segments + 1;
+    struct segment *const segments = realloc(w->segments,
+        ns * sizeof *w->segments);
+
+    if (!segments)
+    {
+        fprintf(stderr, "%s: realloc(3): %s\n", __func__, strerror(errno));
+        return -1;
+    }
+
+    segments[w->n_segments] = (const struct segment){.p = p, .n = n};
+    w->segments = segments;
+    w->n_segments = ns;
+    return 0;
+}
+
+struct wildcard *wildcard_compile(const char *const p, const bool casecmp)
+{
+    struct wildcard *const w = malloc(sizeof *w);
+
+    if (!w)
+    {
+        fprintf(stderr, "%s: malloc(3): %s\n", __func__, strerror(errno));
+        return NULL;
+    }
+
+    *w = (const struct wildcard)
+    {
+        .p = strdup(p),
+        .casecmp = casecmp
+    };
+
+    if (!w->p)
+    {
+        fprintf(stderr, "%s: strdup(3): %s\n", __func__, strerror(errno));
+        goto failure;
+    }
+
+    const char *const first = strchr(w->p, '*');
+
+    if (!first)
+    {
+        w->prefix = (const struct segment){.p = w->p, .n = strlen(w->p)};
+        return w;
+    }
+
+    const char *const last = strrchr(w->p, '*') + 1;
+
+    w->star = true;
+    w->prefix = (const struct segment){.p = w->p, .n = first - w->p};
+    w->suffix = (const struct segment){.p = last, .n = strlen(last)};
+
+    for (const char *s = first + 1; s < last;)
+    {
+        const char *const wc = strchr(s, '*');
+        const size_t n = wc - s;
+
+        if (n && append_segment(w, s, n))
         {
-            const char next = *(wc + 1), wca[2] = {next}, sa[sizeof wca] = {*s};
-
-            if (!cmp(wca, sa))
-            {
-                last = p;
-                p = wc + 1;
-            }
-            else if (next == '*')
-                p++;
-            else
-                s++;
+            fprintf(stderr, "%s: append_segment failed\n", __func__);
+            goto failure;
         }
+
+        s = wc + 1;
     }
 
-    while (*p)
-        if (*p++ != '*')
-            return -1;
+    return w;
 
-    return 0;
+failure:
+    wildcard_free(w);
+    return NULL;
 }